@@ -15,7 +15,11 @@ set GCCOPT=-O3 -Wall -std=c99 -pedantic
 set NAME1=gen
 set NAME2=qsort
 set NAME3=serial_heat
+set NAME4=heat2txt
+set NAME5=merge_kernels
 
 gcc %GCCOPT% %SOURCE%/%NAME1%.c -o %BIN%/%NAME1%
 gcc %GCCOPT% %SOURCE%/%NAME2%.c -o %BIN%/%NAME2%
 gcc %GCCOPT% %SOURCE%/%NAME3%.c -o %BIN%/%NAME3%
+gcc %GCCOPT% %SOURCE%/%NAME4%.c -o %BIN%/%NAME4%
+gcc %GCCOPT% %SOURCE%/%NAME5%.c -lmpi -o %BIN%/%NAME5%
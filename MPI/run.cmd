@@ -58,7 +58,10 @@ set RUNOPT=%5 %6 %7 %8 %9
 
 set RESULT=file
 if "%3"=="heat" (
-    set RESULT=result_kryukov.txt
+    set RESULT=result_kryukov.bin
+)
+if "%3"=="heat3d" (
+    set RESULT=result3d_kryukov.bin
 )
 if "%3"=="merge" (
     set RESULT=sorted_%5
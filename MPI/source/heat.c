@@ -2,9 +2,16 @@
  * heat.c
  *
  * Solving heat equation with MPI
+ * Build with -fopenmp to count every chunk with several OpenMP threads.
+ * Build with -DSINGLE to store fields and send halo in float. Points are
+ * still counted in double, so error is rounding of every step to float.
+ * Maximal difference from tests/serial_heat is 3e-7 for "0.01 300 0.3 0.5"
+ * (3578 steps) and 3e-5 for "2.0 100 1.0 1.0" (78408 steps), where 134 of
+ * 10000 points differ in the last digit of %8.3f table.
+ * Result is written to binary file, use tests/heat2txt to get text table.
  *
  * @author pikryukov
- * @version 4.0
+ * @version 4.19
  *
  * e-mail: kryukov@frtk.ru
  *
@@ -12,323 +19,2982 @@
  * for MIPT MPI course.
  */
 
-#include <stdlib.h> /* strtod, strtoul, malloc, free */
-#include <string.h> /* memcpy */
-#include <stdio.h>  /* fprintf, fopen, fclose */
-#include <math.h>   /* exp */
+#include <stdlib.h> /* strtod, strtoul, malloc, calloc, realloc, free */
+#include <string.h> /* memcpy, strcmp */
+#include <stdio.h>  /* fprintf, fscanf, sprintf */
+#include <math.h>   /* exp, fabs */
 
 #include <mpi.h>
 
-#define FILENAME "result_kryukov.txt"
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
+
+/* Vector kernels are built with GCC target attributes for x86 only */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define X86_KERNELS
+#   include <immintrin.h>
+#endif
+
+#define FILENAME "result_kryukov.bin"
+#define ENSEMBLE_FILENAME "result_kryukov_%u.bin"
+#define CHECKPOINT "checkpoint_kryukov.bin"
+#define CHECKPOINT_TMP "checkpoint_kryukov.tmp"
+#define SNAPSHOT_FILENAME "snapshot_kryukov_%u.bin"
+
+/* Tag of messages to I/O thread */
+#define SNAPSHOT_TAG 1
+
+/* Alignment of fields and rows in bytes, enough for AVX-512 */
+#define ALIGN 64
+
+/* Type of stored points */
+#ifdef SINGLE
+typedef float Real;
+#   define REAL_MPI MPI_FLOAT
+#else
+typedef double Real;
+#   define REAL_MPI MPI_DOUBLE
+#endif
+
+/* Minimal amount of points counted by several OpenMP threads */
+#define PARALLEL_MIN 4096
+
+/* Points in vector of exponent, columns of fill() are aligned to it */
+#define EXP_WIDTH 4
 
 #define ERRORPRINT(x) {if (!rank) fprintf(stderr, x); MPI_Finalize(); exit(1);}
 
+/* Usage is split at lines, as ISO C90 does not allow long strings */
+static const char* const usage[] =
+{
+    "Arguments are following: T, N, a, b [options]\n",
+    "Options:\n",
+    "  -overlap        overlap halo exchange with interior counting\n",
+    "  -strips         split grid at horizontal strips only\n",
+    "  -halo k         exchange halo of width k every k steps\n",
+    "  -kernel s       counting kernel: scalar, sse2, avx2, avx512\n",
+    "                  (the best supported one by default)\n",
+    "  -nt             non-temporal stores of new layer\n",
+    "  -tile b         make all steps between exchanges in tiles of b rows\n",
+    "  -threads n      amount of OpenMP threads in every process\n",
+    "  -checkpoint n   write checkpoint every n steps\n",
+    "  -restart        continue from the last checkpoint of the same run\n",
+    "  -persistent     exchange with persistent requests\n",
+    "  -eps e          stop when change of field in one step is less than e\n",
+    "  -check k        check change of field and balance every k steps,\n",
+    "                  100 by default\n",
+    "  -adi tau        implicit ADI steps of tau instead of explicit ones\n",
+    "  -order4         compact 9-point scheme of fourth order\n",
+    "  -stats k        print total heat, max, min and centroid every k steps\n",
+    "  -snapshot k d   write every d-th point to snapshot_kryukov_<step>.bin\n",
+    "                  every k steps by one more dedicated I/O thread\n",
+    "  -balance k      split rows in proportion to speed of threads\n",
+    "                  measured in k steps before counting\n",
+    "  -rebalance r    move rows between threads when the slowest one is\n",
+    "                  busy r times longer than average one\n",
+    "  -shared         keep fields in shared memory of node and copy halo\n",
+    "                  of neighbours on the same node directly\n",
+    "  -rma s          one-sided exchange by puts to halo of neighbours\n",
+    "                  in epochs of fence or pscw (post/start/complete/wait)\n",
+    "  -ensemble f     count cases from file f with lines 'T a b' together,\n",
+    "                  case i is written to result_kryukov_i.bin\n",
+    NULL
+};
+
+/**
+ * Header of binary file with grid, grid rows follow it
+ * Numbers are stored in native byte order.
+ */
+typedef struct
+{
+    char magic[4];     /* "HEAT" */
+    unsigned N;        /* Grid size */
+    unsigned elemSize; /* Size of one point in bytes */
+    unsigned steps;    /* Amount of steps made */
+    unsigned order;    /* Order of scheme, 2 or 4 */
+    unsigned reserved; /* Zero, keeps parameters aligned */
+    double T, a, b;    /* Parameters of run */
+} Header;
+
+/**
+ * Optional run parameters
+ */
+typedef struct
+{
+    int overlap;        /* Non-blocking exchange hidden behind interior counting */
+    int strips;         /* 1D decomposition instead of 2D one */
+    unsigned halo;      /* Halo width, amount of steps between exchanges */
+    const char* kernel; /* Name of counting kernel, NULL for the best one */
+    int nt;             /* Non-temporal stores in counting kernel */
+    unsigned tile;      /* Rows in tile of time skewing, 0 for no tiling */
+    unsigned threads;   /* Amount of OpenMP threads, 0 for default */
+    unsigned checkpoint; /* Steps between checkpoints, 0 for no checkpoints */
+    int restart;        /* Start from checkpoint */
+    int persistent;     /* Persistent requests of exchange */
+    double eps;         /* Maximal change in steady state, 0 to make all steps */
+    unsigned check;     /* Steps between checks of steady state */
+    double adi;         /* Step of implicit ADI integrator, 0 for explicit one */
+    const char* ensemble; /* File with cases, NULL for one case from arguments */
+    int order4;         /* Compact 9-point scheme instead of 5-point one */
+    unsigned stats;     /* Steps between statistics, 0 for no statistics */
+    unsigned snapshot;  /* Steps between snapshots, 0 for no snapshots */
+    unsigned decimate;  /* Distance between points of snapshots */
+    unsigned balance;   /* Steps of speed measurement, 0 for even split */
+    double rebalance;   /* Allowed excess of busy time over average, 0 to keep split */
+    int shared;         /* Fields in shared memory of node, halo is copied directly */
+    const char* rma;    /* Epochs of one-sided exchange: fence or pscw, NULL for messages */
+} Options;
+
+/**
+ * Parameters of one run
+ */
+typedef struct
+{
+    double T, a, b;
+} Case;
+
+/*
+ * The whole grid is split at rectangular chunks on Cartesian grid of threads.
+ * Every chunk is surrounded by halo of vectors from neighbour threads:
+ *
+ * coords == (0, 0):            coords == (1, 1):
+ *
+ *  |@@@@@@@@@@|                  ************      <- vector from upper thread
+ *  |@  DATA   |*               *|            |*
+ *  |@         |* <- vector     *|    DATA    |*
+ *  |@_________|*    from right *|____________|*
+ *    **********      thread      ************      <- vector from lower thread
+ *
+ * @ is for edges of the whole grid, which are not counted.
+ * As you can see, in every chunk we should make calculations only in inner
+ * rectangle which does not touch edges of the whole grid.
+ *
+ * In memory chunk is stored with its halo of width H, so own point (y, x) is
+ * f[(y + H) * ld + x + H], where ld = cols + 2 * H rounded up to ALIGN bytes,
+ * so every row starts at aligned address.
+ *
+ * Halo of width H > 1 lets thread make H steps after one exchange.
+ * Every step spoils one more line of halo, so counted rectangle is
+ * widened towards neighbours by H - 1 points on the first step,
+ * H - 2 points on the second one, etc.:
+ *
+ *  step 1     step 2     step H == 3
+ *  ........   ........   ........
+ *  .######.   ........   ........
+ *  .######.   ..####..   ........
+ *  .######.   ..####..   ...##...
+ *  .######.   ..####..   ........
+ *  .######.   ........   ........
+ *  ........   ........   ........
+ */
+
+/**
+ * Chunk of grid owned by thread
+ */
+typedef struct
+{
+    MPI_Comm comm;       /* Cartesian communicator */
+    int dims[2];         /* Amount of threads by rows and by columns */
+    int coords[2];       /* Coordinates of thread in Cartesian grid */
+    int up, down;        /* Neighbours by rows, MPI_PROC_NULL on grid edges */
+    int left, right;     /* Neighbours by columns */
+    size_t N;            /* Grid size */
+    size_t rows, cols;   /* Amount of own rows and columns */
+    size_t y0, x0;       /* Position of the first own point in grid */
+    size_t* bounds;      /* First rows of rows of threads and N, NULL for even split */
+    size_t H;            /* Halo width */
+    size_t ld;           /* Distance between rows in memory */
+    size_t ylo, yhi;     /* Counted rows, [ylo, yhi), in memory coordinates */
+    size_t xlo, xhi;     /* Counted columns, [xlo, xhi) */
+    MPI_Datatype column; /* H columns of own rows */
+    MPI_Datatype row;    /* H rows of own columns, without corners of halo */
+    MPI_Datatype band;   /* H whole rows, with corners of halo */
+} Chunk;
+
+/**
+ * Scatters grid lines to threads with minimal recip
+ * @param N amount of grid lines
+ * @param parts amount of threads lines are split to
+ * @param part number of thread
+ * @param offset first line of thread
+ * @return amount of lines of thread
+ */
+size_t scatter(size_t N, int parts, int part, size_t* offset)
+{
+    /* Grid is scattered to threads in this way:
+    `*                    |-> amount == 6
+     * 0:  0  1  2  3  4  5
+     * 1:  6  7  8  9 10 11
+     * 2: 12 13 14 15 16 17
+     * 3: 18 19 20 21 22 23 24 <- resRank
+     * 4: 25 26 27 28 29 30 31
+     */
+    const size_t resRank = parts - N % parts;
+    const size_t amount = N / parts;
+
+    *offset = part * amount;
+    if (part < resRank)
+        return amount;
+
+    /* Split recip to the bottom threads */
+    *offset += part - resRank;
+    return amount + 1;
+}
+
+/**
+ * Gets position of chunk of some thread in grid
+ * @param c chunk of current thread
+ * @param rank rank of thread in Cartesian communicator
+ * @param y0 first row of chunk
+ * @param rows amount of rows of chunk
+ * @param x0 first column of chunk
+ * @param cols amount of columns of chunk
+ */
+void locate(const Chunk* c, int rank, size_t* y0, size_t* rows,
+            size_t* x0, size_t* cols)
+{
+    int coords[2];
+    MPI_Cart_coords(c->comm, rank, 2, coords);
+    if (c->bounds)
+    {
+        *y0 = c->bounds[coords[0]];
+        *rows = c->bounds[coords[0] + 1] - *y0;
+    }
+    else
+        *rows = scatter(c->N, c->dims[0], coords[0], y0);
+    *cols = scatter(c->N, c->dims[1], coords[1], x0);
+}
+
+/**
+ * Gets distance between rows of chunk in memory
+ * @param cols amount of own columns
+ * @param H halo width
+ * @return cols + 2 * H rounded up to ALIGN bytes
+ */
+size_t rowLength(size_t cols, size_t H)
+{
+    return (cols + 2 * H + ALIGN / sizeof(Real) - 1) / (ALIGN / sizeof(Real))
+         * (ALIGN / sizeof(Real));
+}
+
+/**
+ * Splits grid to chunks between threads
+ * @param c created chunk
+ * @param N grid size
+ * @param strips 1 if grid should be split at horizontal strips only
+ * @param H halo width
+ * @param comm communicator of counting threads
+ * @param bounds first rows of rows of threads and N, NULL to split rows evenly
+ * @return 0 on success, -1 if grid is too small for such amount of threads,
+ *         -2 if chunks are too small for such halo
+ */
+int createChunk(Chunk* c, unsigned N, int strips, unsigned H, MPI_Comm comm,
+                const size_t* bounds)
+{
+    const int periods[2] = {0, 0};
+    int rank, size, i;
+
+    MPI_Comm_size(comm, &size);
+
+    c->dims[0] = strips ? size : 0;
+    c->dims[1] = strips ? 1 : 0;
+    MPI_Dims_create(size, 2, c->dims);
+    if (c->dims[0] > N || c->dims[1] > N)
+        return -1;
+
+    /* Halo is filled by the nearest neighbour only */
+    if (N / c->dims[0] < H || N / c->dims[1] < H)
+        return -2;
+    for (i = 0; bounds && i < c->dims[0]; ++i)
+        if (bounds[i + 1] < bounds[i] + H)
+            return -2;
+
+    c->bounds = NULL;
+    if (bounds)
+    {
+        c->bounds = (size_t*)malloc((c->dims[0] + 1) * sizeof(size_t));
+        memcpy(c->bounds, bounds, (c->dims[0] + 1) * sizeof(size_t));
+    }
+
+    /* Keep ranks order, so 0 thread is still in the top left corner */
+    MPI_Cart_create(comm, 2, c->dims, periods, 0, &c->comm);
+    MPI_Comm_rank(c->comm, &rank);
+    MPI_Cart_coords(c->comm, rank, 2, c->coords);
+    MPI_Cart_shift(c->comm, 0, 1, &c->up, &c->down);
+    MPI_Cart_shift(c->comm, 1, 1, &c->left, &c->right);
+
+    c->N = N;
+    locate(c, rank, &c->y0, &c->rows, &c->x0, &c->cols);
+    c->H = H;
+    c->ld = rowLength(c->cols, H);
+
+    /* Edges of the whole grid are not counted */
+    c->ylo = H + (c->y0 == 0);
+    c->yhi = H + c->rows - (c->y0 + c->rows == N);
+    c->xlo = H + (c->x0 == 0);
+    c->xhi = H + c->cols - (c->x0 + c->cols == N);
+
+    MPI_Type_vector(c->rows, H, c->ld, REAL_MPI, &c->column);
+    MPI_Type_commit(&c->column);
+    MPI_Type_vector(H, c->cols, c->ld, REAL_MPI, &c->row);
+    MPI_Type_commit(&c->row);
+    MPI_Type_contiguous(H * c->ld, REAL_MPI, &c->band);
+    MPI_Type_commit(&c->band);
+    return 0;
+}
+
+/**
+ * Stacks exchanged datatypes of several fields following each other,
+ * so one message carries halo of all fields
+ * @param c chunk
+ * @param amount amount of fields
+ * @param area distance between fields in elements
+ */
+void stackCases(Chunk* c, unsigned amount, size_t area)
+{
+    MPI_Datatype* types[3];
+    int i;
+
+    types[0] = &c->column;
+    types[1] = &c->row;
+    types[2] = &c->band;
+    for (i = 0; i < 3; ++i)
+    {
+        MPI_Datatype one = *types[i];
+        MPI_Type_create_hvector(amount, 1, area * sizeof(Real), one, types[i]);
+        MPI_Type_commit(types[i]);
+        MPI_Type_free(&one);
+    }
+}
+
+/**
+ * Frees chunk resources
+ * @param c chunk
+ */
+void freeChunk(Chunk* c)
+{
+    MPI_Type_free(&c->column);
+    MPI_Type_free(&c->row);
+    MPI_Type_free(&c->band);
+    MPI_Comm_free(&c->comm);
+    free(c->bounds);
+}
+
+/**
+ * Creates datatypes of some thread's chunk in the whole grid
+ * and of own points in chunk with halo
+ * @param c chunk
+ * @param rank rank of thread whose chunk is described
+ * @param grid datatype of chunk in the whole N * N grid
+ * @param own datatype of own points in chunk with halo, may be NULL
+ *            if rank is not the current thread
+ */
+void chunkTypes(const Chunk* c, int rank, MPI_Datatype* grid, MPI_Datatype* own)
+{
+    size_t y0, rows, x0, cols;
+    int sizes[2], subsizes[2], starts[2];
+
+    locate(c, rank, &y0, &rows, &x0, &cols);
+    sizes[0] = sizes[1] = c->N;
+    subsizes[0] = rows;
+    subsizes[1] = cols;
+    starts[0] = y0;
+    starts[1] = x0;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, REAL_MPI, grid);
+    MPI_Type_commit(grid);
+    if (!own)
+        return;
+
+    sizes[0] = rows + 2 * c->H;
+    sizes[1] = c->ld;
+    starts[0] = starts[1] = c->H;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, REAL_MPI, own);
+    MPI_Type_commit(own);
+}
+
+/**
+ * Writes chunks of all threads to binary file with collective MPI-IO
+ * @param filename file name
+ * @param f chunk with halo
+ * @param c chunk
+ * @param header file header, it is written by 0 thread
+ */
+void writeGrid(const char* filename, Real* f, const Chunk* c, const Header* header)
+{
+    int rank;
+    MPI_File fh;
+    MPI_Datatype grid, own;
+
+    MPI_Comm_rank(c->comm, &rank);
+    chunkTypes(c, rank, &grid, &own);
+
+    MPI_File_open(c->comm, (char*)filename, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                  MPI_INFO_NULL, &fh);
+    MPI_File_set_size(fh, 0);
+    if (!rank)
+        MPI_File_write_at(fh, 0, (void*)header, sizeof(Header), MPI_BYTE, MPI_STATUS_IGNORE);
+
+    /* Every thread sees only its chunk of grid */
+    MPI_File_set_view(fh, sizeof(Header), REAL_MPI, grid, "native", MPI_INFO_NULL);
+    MPI_File_write_at_all(fh, 0, f, 1, own, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+
+    MPI_Type_free(&grid);
+    MPI_Type_free(&own);
+}
+
+/**
+ * Reads chunk of grid from binary file written by writeGrid()
+ * As the whole grid is stored, file may be written by another amount of threads.
+ * @param filename file name
+ * @param f chunk with halo
+ * @param c chunk
+ * @param header read file header
+ * @return 0 on success, -1 if file is absent or has another grid
+ */
+int readGrid(const char* filename, Real* f, const Chunk* c, Header* header)
+{
+    int rank;
+    MPI_File fh;
+    MPI_Datatype grid, own;
+
+    if (MPI_File_open(c->comm, (char*)filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh)
+        != MPI_SUCCESS)
+        return -1;
+
+    MPI_File_read_at_all(fh, 0, header, sizeof(Header), MPI_BYTE, MPI_STATUS_IGNORE);
+    if (memcmp(header->magic, "HEAT", 4) || header->N != c->N
+        || header->elemSize != sizeof(Real))
+    {
+        MPI_File_close(&fh);
+        return -1;
+    }
+
+    MPI_Comm_rank(c->comm, &rank);
+    chunkTypes(c, rank, &grid, &own);
+    MPI_File_set_view(fh, sizeof(Header), REAL_MPI, grid, "native", MPI_INFO_NULL);
+    MPI_File_read_at_all(fh, 0, f, 1, own, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+
+    MPI_Type_free(&grid);
+    MPI_Type_free(&own);
+    return 0;
+}
+
+/**
+ * Writes checkpoint
+ * Checkpoint is written to temporary file and renamed after that,
+ * so the previous checkpoint is valid if thread crashes during writing.
+ * @param f chunk with halo
+ * @param c chunk
+ * @param header file header with amount of made steps
+ * @return time of writing
+ */
+double checkpoint(Real* f, const Chunk* c, const Header* header)
+{
+    int rank;
+    double time = -MPI_Wtime();
+
+    MPI_Comm_rank(c->comm, &rank);
+    writeGrid(CHECKPOINT_TMP, f, c, header);
+    if (!rank)
+        rename(CHECKPOINT_TMP, CHECKPOINT);
+    MPI_Barrier(c->comm);
+    return time += MPI_Wtime();
+}
+
+/*
+ * Decimated snapshots are written by the last thread, which does not count.
+ * Counting threads copy every d-th point of every d-th row of their chunks
+ * to buffer and send it without waiting, so they never wait for file system.
+ * At start every counting thread tells I/O thread its box in decimated grid.
+ * Every snapshot starts with message of 0 thread with step number.
+ */
+
+/**
+ * Snapshots sender of counting thread
+ */
+typedef struct
+{
+    int io;              /* Rank of I/O thread */
+    size_t d;            /* Distance between written points */
+    size_t y, x;         /* The first written own point in memory coordinates */
+    size_t rows, cols;   /* Amount of written rows and columns */
+    Real* buffer;        /* Points being sent */
+    MPI_Request req;     /* Sending of buffer */
+} Snapshots;
+
+/**
+ * Writes snapshots received from counting threads till they stop
+ * @param counters amount of counting threads
+ * @param header header of snapshot files, N is size of decimated grid
+ */
+void writeSnapshots(int counters, const Header* header)
+{
+    const size_t M = header->N;
+    Real* grid = (Real*)malloc(M * M * sizeof(Real));
+    MPI_Datatype* boxes = (MPI_Datatype*)malloc(counters * sizeof(MPI_Datatype));
+    unsigned* sizes = (unsigned*)malloc(counters * sizeof(unsigned));
+    unsigned message[2]; /* step and 1, 0 to stop */
+    Header out = *header;
+    int r;
+
+    for (r = 0; r < counters; ++r)
+    {
+        unsigned box[4]; /* first row, rows, first column, columns */
+        MPI_Recv(box, 4, MPI_UNSIGNED, r, SNAPSHOT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        sizes[r] = box[1] * box[3];
+        if (sizes[r])
+        {
+            int gridSizes[2], subsizes[2], starts[2];
+            gridSizes[0] = gridSizes[1] = M;
+            starts[0] = box[0];
+            subsizes[0] = box[1];
+            starts[1] = box[2];
+            subsizes[1] = box[3];
+            MPI_Type_create_subarray(2, gridSizes, subsizes, starts, MPI_ORDER_C,
+                                     REAL_MPI, boxes + r);
+            MPI_Type_commit(boxes + r);
+        }
+    }
+
+    for (;;)
+    {
+        char filename[64];
+        FILE* fp;
+
+        MPI_Recv(message, 2, MPI_UNSIGNED, 0, SNAPSHOT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (!message[1])
+            break;
+        for (r = 0; r < counters; ++r)
+            if (sizes[r])
+                MPI_Recv(grid, 1, boxes[r], r, SNAPSHOT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+        out.steps = message[0];
+        sprintf(filename, SNAPSHOT_FILENAME, message[0]);
+        fp = fopen(filename, "wb");
+        if (!fp)
+            continue;
+        fwrite(&out, sizeof(Header), 1, fp);
+        fwrite(grid, sizeof(Real), M * M, fp);
+        fclose(fp);
+    }
+
+    for (r = 0; r < counters; ++r)
+        if (sizes[r])
+            MPI_Type_free(boxes + r);
+    free(sizes);
+    free(boxes);
+    free(grid);
+}
+
+/**
+ * Prepares sending of snapshots and tells I/O thread box of chunk
+ * @param s snapshots sender
+ * @param c chunk
+ * @param d distance between written points
+ * @param io rank of I/O thread in MPI_COMM_WORLD
+ */
+void startSnapshots(Snapshots* s, const Chunk* c, size_t d, int io)
+{
+    /* The first multiples of d among own rows and columns */
+    const size_t gy = (c->y0 + d - 1) / d * d;
+    const size_t gx = (c->x0 + d - 1) / d * d;
+    unsigned box[4];
+
+    s->io = io;
+    s->d = d;
+    s->y = c->H + gy - c->y0;
+    s->x = c->H + gx - c->x0;
+    s->rows = gy < c->y0 + c->rows ? (c->y0 + c->rows - 1 - gy) / d + 1 : 0;
+    s->cols = gx < c->x0 + c->cols ? (c->x0 + c->cols - 1 - gx) / d + 1 : 0;
+    s->buffer = (Real*)malloc((s->rows * s->cols + 1) * sizeof(Real));
+    s->req = MPI_REQUEST_NULL;
+
+    box[0] = gy / d;
+    box[1] = s->rows;
+    box[2] = gx / d;
+    box[3] = s->cols;
+    MPI_Send(box, 4, MPI_UNSIGNED, io, SNAPSHOT_TAG, MPI_COMM_WORLD);
+}
+
+/**
+ * Sends snapshot of field to I/O thread without waiting
+ * @param s snapshots sender
+ * @param f field
+ * @param c chunk
+ * @param step number of step
+ */
+void sendSnapshot(Snapshots* s, const Real* f, const Chunk* c, unsigned step)
+{
+    size_t i, j;
+    Real* p = s->buffer;
+    int rank;
+
+    /* Buffer is free after the previous snapshot is received */
+    MPI_Wait(&s->req, MPI_STATUS_IGNORE);
+    MPI_Comm_rank(c->comm, &rank);
+    if (!rank)
+    {
+        unsigned message[2];
+        message[0] = step;
+        message[1] = 1;
+        MPI_Send(message, 2, MPI_UNSIGNED, s->io, SNAPSHOT_TAG, MPI_COMM_WORLD);
+    }
+    if (!s->rows || !s->cols)
+        return;
+
+    for (i = 0; i < s->rows; ++i)
+        for (j = 0; j < s->cols; ++j)
+            *(p++) = f[(s->y + i * s->d) * c->ld + s->x + j * s->d];
+    MPI_Isend(s->buffer, s->rows * s->cols, REAL_MPI, s->io, SNAPSHOT_TAG,
+              MPI_COMM_WORLD, &s->req);
+}
+
+/**
+ * Waits for the last snapshot and stops I/O thread
+ * @param s snapshots sender
+ * @param c chunk
+ */
+void stopSnapshots(Snapshots* s, const Chunk* c)
+{
+    int rank;
+
+    MPI_Wait(&s->req, MPI_STATUS_IGNORE);
+    MPI_Comm_rank(c->comm, &rank);
+    if (!rank)
+    {
+        unsigned message[2] = {0, 0};
+        MPI_Send(message, 2, MPI_UNSIGNED, s->io, SNAPSHOT_TAG, MPI_COMM_WORLD);
+    }
+    free(s->buffer);
+}
+
+/**
+ * Allocates zeroed field aligned at ALIGN bytes
+ * @param n amount of elements
+ * @return pointer to field, should be freed by freeField()
+ */
+Real* allocField(size_t n)
+{
+    char* raw = (char*)calloc(n * sizeof(Real) + ALIGN + sizeof(void*), 1);
+    char* f = raw + sizeof(void*);
+
+    f += ALIGN - (size_t)f % ALIGN;
+    ((void**)f)[-1] = raw;
+    return (Real*)f;
+}
+
+/**
+ * Touches field by the same OpenMP threads which count it,
+ * so its pages are placed in their memory on NUMA systems (first touch)
+ * @param f field
+ * @param c chunk
+ */
+void touchField(Real* f, const Chunk* c)
+{
+    const long height = c->rows + 2 * c->H;
+    long y;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (y = 0; y < height; ++y)
+        memset(f + y * c->ld, 0, c->ld * sizeof(Real));
+}
+
+/**
+ * Frees field allocated by allocField()
+ * @param f field
+ */
+void freeField(Real* f)
+{
+    free(((void**)f)[-1]);
+}
+
+/**
+ * Exponent of array in place
+ */
+typedef void (*Exponent)(double* v, size_t n);
+
+/**
+ * Scalar exponent of array
+ * @param v array
+ * @param n amount of elements
+ */
+void expScalar(double* v, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        v[i] = exp(v[i]);
+}
+
+/* Exponent chosen at start up together with kernel */
+static Exponent exponent = expScalar;
+
+#ifdef X86_KERNELS
+/**
+ * AVX2 exponent of array, differs from exp() by 1 ulp at most
+ * Vectors are taken from the start of array and the rest is counted by exp().
+ * exp(v) = 2^k * exp(r), where k = round(v / ln 2) and |r| <= ln 2 / 2.
+ * exp(r) is Taylor polynomial of 13th degree, and ln 2 is split in two
+ * parts, so k * LN2_HI is exact. 2^k is built from exponent bits in two
+ * halves, so results near underflow are denormal as in exp().
+ * @param v array
+ * @param n amount of elements
+ */
+__attribute__((target("avx2")))
+void expAVX2(double* v, size_t n)
+{
+    const __m256d log2e = _mm256_set1_pd(1.4426950408889634);
+    const __m256d ln2hi = _mm256_set1_pd(6.93147180369123816490e-01);
+    const __m256d ln2lo = _mm256_set1_pd(1.90821492927058770002e-10);
+    const __m256d lo = _mm256_set1_pd(-746.);
+    const __m256d hi = _mm256_set1_pd(710.);
+    const __m256d half = _mm256_set1_pd(.5);
+    const __m256d bias = _mm256_set1_pd(1023. + 4503599627370496.); /* 2^52 */
+    size_t i;
+
+    for (i = 0; i + EXP_WIDTH <= n; i += EXP_WIDTH)
+    {
+        const __m256d x = _mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(v + i), lo), hi);
+        const __m256d k = _mm256_round_pd(_mm256_mul_pd(x, log2e),
+                                          _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        const __m256d k1 = _mm256_floor_pd(_mm256_mul_pd(k, half));
+        const __m256d r = _mm256_sub_pd(_mm256_sub_pd(x, _mm256_mul_pd(k, ln2hi)),
+                                        _mm256_mul_pd(k, ln2lo));
+        __m256d p = _mm256_set1_pd(1. / 6227020800.);
+        __m256d s1, s2;
+
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 479001600.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 39916800.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 3628800.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 362880.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 40320.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 5040.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 720.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 120.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 24.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1. / 6.));
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), half);
+        p = _mm256_mul_pd(_mm256_mul_pd(p, r), r);
+        p = _mm256_add_pd(_mm256_add_pd(p, r), _mm256_set1_pd(1.));
+
+        /* Biased exponent is in low bits of mantissa of 2^52 + 1023 + k */
+        s1 = _mm256_castsi256_pd(_mm256_slli_epi64(
+                _mm256_castpd_si256(_mm256_add_pd(k1, bias)), 52));
+        s2 = _mm256_castsi256_pd(_mm256_slli_epi64(
+                _mm256_castpd_si256(_mm256_add_pd(_mm256_sub_pd(k, k1), bias)), 52));
+        _mm256_storeu_pd(v + i, _mm256_mul_pd(_mm256_mul_pd(p, s1), s2));
+    }
+    expScalar(v + i, n - i);
+}
+#endif
+
+/**
+ * Fills chunk with initial values exp(multiplier * (x * x - 2 * b * x * y + y * y))
+ * Terms x * x and 2 * b * x of columns are counted once, so arguments are
+ * the same as in straight formula, and exponent of every row is vector one.
+ * Row is widened to columns aligned to EXP_WIDTH, so every column is counted
+ * by vector or by exp() regardless of split of grid between threads.
+ * @param f filling field
+ * @param a alpha parameter of input function
+ * @param b beta parameter of input function
+ * @param c chunk
+ */
+void fill(Real* f, double a, double b, const Chunk* c)
+{
+    /* Widened columns [x0 - shift, x0 - shift + cols) */
+    const size_t shift = c->x0 % EXP_WIDTH;
+    const size_t end = (c->x0 + c->cols + EXP_WIDTH - 1) / EXP_WIDTH * EXP_WIDTH;
+    const size_t cols = (end < c->N ? end : c->N) - (c->x0 - shift);
+    double* xx = (double*)malloc(cols * sizeof(double));
+    double* bx = (double*)malloc(cols * sizeof(double));
+    size_t j;
+    long i;
+
+    /* Exponent multiplier */
+    double multiplier = ((c->N - 1) * a);
+    multiplier *= multiplier;
+    multiplier = - 1. / multiplier;
+
+    for (j = 0; j < cols; ++j)
+    {
+        const size_t x = c->x0 - shift + j;
+        xx[j] = x * x;
+        bx[j] = 2 * b * x;
+    }
+
+    /* Every thread has one row buffer */
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+    {
+        double* row = (double*)malloc(cols * sizeof(double));
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (i = 0; i < (long)c->rows; ++i)
+        {
+            const size_t y = c->y0 + i;
+            const double yy = y * y;
+            Real* p = f + (c->H + i) * c->ld + c->H;
+            size_t k;
+
+            for (k = 0; k < cols; ++k)
+                row[k] = multiplier * (xx[k] - bx[k] * y + yy);
+            exponent(row, cols);
+            for (k = 0; k < c->cols; ++k)
+                p[k] = row[shift + k];
+        }
+        free(row);
+    }
+    free(bx);
+    free(xx);
+}
+
+/**
+ * Copy edges of the whole grid from one field to another
+ * Edges in halo are copied too, as they are read by widened counting.
+ * N.B. that edges are not changed after this copy.
+ * @param old old field
+ * @param new new field
+ * @param c chunk
+ */
+void copyEdges(Real* old, Real* new, const Chunk* c)
+{
+    /* Side edges */
+    const ptrdiff_t diff = old - new;
+    const long height = c->rows + 2 * c->H;
+    long y;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (y = 0; y < height; ++y)
+    {
+        Real* dest = new + y * c->ld;
+
+        /* Left edge */
+        if (c->xlo > c->H)
+            *(dest + c->H) = *(dest + c->H + diff);
+
+        /* Right edge */
+        if (c->xhi < c->H + c->cols)
+            *(dest + c->xhi) = *(dest + c->xhi + diff);
+    }
+
+    /* Top edge */
+    if (c->ylo > c->H)
+        memcpy(new + c->H * c->ld, old + c->H * c->ld, c->ld * sizeof(Real));
+
+    /* Bottom edge */
+    if (c->yhi < c->H + c->rows)
+        memcpy(new + c->yhi * c->ld, old + c->yhi * c->ld, c->ld * sizeof(Real));
+}
+
+ /* Thread-look exchage scheme, it is the same for rows and columns:
+  *     ODD          EVEN
+  *   <-|0|          |0|-<         
+  *   >-|1|          |1|->
+  *     |2|->      >-|2|
+  *     |3|-<      <-|3|
+  */
+
+/**
+ * Exchange of vectors with two neighbours in one dimension
+ * @param lo address of vector sent to lower neighbour
+ * @param hi address of vector sent to upper neighbour
+ * @param dist distance between sent vector and received one
+ * @param count amount of sent elements
+ * @param type type of sent elements
+ * @param prev lower neighbour
+ * @param next upper neighbour
+ * @param odd parity of thread coordinate
+ * @param comm communicator
+ */
+void exchangeLine(Real* lo, Real* hi, ptrdiff_t dist, int count, MPI_Datatype type,
+                  int prev, int next, int odd, MPI_Comm comm)
+{
+    if (odd)
+    {
+        MPI_Send(lo       , count, type, prev, 0, comm);
+        MPI_Recv(lo - dist, count, type, prev, 0, comm, MPI_STATUS_IGNORE);
+        MPI_Send(hi       , count, type, next, 0, comm);
+        MPI_Recv(hi + dist, count, type, next, 0, comm, MPI_STATUS_IGNORE);
+    }
+    else
+    {
+        MPI_Recv(hi + dist, count, type, next, 0, comm, MPI_STATUS_IGNORE);
+        MPI_Send(hi       , count, type, next, 0, comm);
+        MPI_Recv(lo - dist, count, type, prev, 0, comm, MPI_STATUS_IGNORE);
+        MPI_Send(lo       , count, type, prev, 0, comm);
+    }
+}
+
+/* Vectors exchange scheme
+ *
+ * |            |
+ * |____________| <->  ************
+ *  ************  <-> |            |
+ *                    |            |
+ *
+ * Columns are exchanged first, so rows are sent with corners of halo.
+ */
+/**
+ * Exchange 
+ * @param f exchanging field
+ * @param c chunk
+ */
+void exchange(Real* f, const Chunk* c)
+{
+    const size_t ld = c->ld;
+    const size_t H = c->H;
+
+    exchangeLine(f + H * ld + H, f + H * ld + c->cols, H, 1, c->column,
+                 c->left, c->right, c->coords[1] % 2, c->comm);
+    exchangeLine(f + H * ld, f + c->rows * ld, H * ld, 1, c->band,
+                 c->up, c->down, c->coords[0] % 2, c->comm);
+}
+
+/**
+ * Creates requests of exchange of edges with neighbour threads
+ * Requests 0-3 exchange columns, requests 4-7 exchange rows.
+ * Unlike exchange(), it does not need odd/even ordering, as nothing is blocked.
+ * @param f exchanging field
+ * @param c chunk
+ * @param corners 1 if rows are sent with corners of halo, so requests 4-7
+ *                must be started after columns are received
+ * @param persistent 1 to create persistent requests, 0 to start ones
+ *                   (corners are not allowed then)
+ * @param reqs array of 8 requests
+ */
+void exchangeRequests(Real* f, const Chunk* c, int corners, int persistent,
+                      MPI_Request* reqs)
+{
+    const size_t ld = c->ld;
+    const size_t H = c->H;
+    const size_t first = corners ? 0 : H; /* first sent column of rows */
+    int i;
+
+    /* Left, right, up, down */
+    Real* recvs[4];
+    Real* sends[4];
+    int peers[4], counts[4];
+    MPI_Datatype types[4];
+
+    recvs[0] = f + H * ld;
+    sends[0] = f + H * ld + H;
+    recvs[1] = f + H * ld + H + c->cols;
+    sends[1] = f + H * ld + c->cols;
+    recvs[2] = f + first;
+    sends[2] = f + H * ld + first;
+    recvs[3] = f + (H + c->rows) * ld + first;
+    sends[3] = f + c->rows * ld + first;
+    peers[0] = c->left;
+    peers[1] = c->right;
+    peers[2] = c->up;
+    peers[3] = c->down;
+    counts[0] = counts[1] = 1;
+    types[0] = types[1] = c->column;
+    counts[2] = counts[3] = 1;
+    types[2] = types[3] = corners ? c->band : c->row;
+
+    for (i = 0; i < 4; ++i)
+        if (persistent)
+        {
+            MPI_Recv_init(recvs[i], counts[i], types[i], peers[i], 0, c->comm, reqs + 2 * i);
+            MPI_Send_init(sends[i], counts[i], types[i], peers[i], 0, c->comm, reqs + 2 * i + 1);
+        }
+        else
+        {
+            MPI_Irecv(recvs[i], counts[i], types[i], peers[i], 0, c->comm, reqs + 2 * i);
+            MPI_Isend(sends[i], counts[i], types[i], peers[i], 0, c->comm, reqs + 2 * i + 1);
+        }
+}
+
+/**
+ * Exchange with persistent requests, the same as exchange()
+ * @param reqs requests created by exchangeRequests() with corners
+ */
+void exchangePersistent(MPI_Request* reqs)
+{
+    MPI_Startall(4, reqs);
+    MPI_Waitall(4, reqs, MPI_STATUSES_IGNORE);
+    MPI_Startall(4, reqs + 4);
+    MPI_Waitall(4, reqs + 4, MPI_STATUSES_IGNORE);
+}
+
+/*
+ * Threads of one node may keep their fields in shared memory window.
+ * Then halo from neighbours of the same node is copied directly from their
+ * fields instead of messages, which are packed, copied through the
+ * shared memory transport of MPI and unpacked. Neighbours on other nodes
+ * still get messages. Every thread counts the same one of its two fields
+ * at the same step, so neighbour's old layer is found by own one.
+ * Copying neighbour's rows needs its halo columns, so columns are
+ * exchanged first, and threads of the node are synchronized before
+ * each half of exchange.
+ */
+
+/**
+ * Fields of threads of one node in shared memory
+ */
+typedef struct
+{
+    MPI_Comm node;       /* Threads of the same node */
+    MPI_Win win;         /* Both fields of every thread of the node */
+    Real* base;          /* Own first field, the second one follows it */
+    int ranks[4];        /* Left, right, up and down neighbours getting messages */
+    Real* peers[4];      /* First fields of neighbours on the same node, or NULL */
+    size_t ld[4];        /* Distance between rows in fields of neighbours */
+    size_t area[4];      /* Size of one field of neighbours */
+    size_t offset[4];    /* Sent halo of neighbours: column or row */
+} Shared;
+
+/**
+ * Synchronizes threads of node, so their shared fields are not changed
+ * till every one finishes reading and writing
+ * @param s shared fields
+ */
+void syncShared(const Shared* s)
+{
+    MPI_Win_sync(s->win);
+    MPI_Barrier(s->node);
+    MPI_Win_sync(s->win);
+}
+
+/**
+ * Allocates both fields of thread in shared memory of node
+ * @param s created shared fields
+ * @param c chunk
+ * @param area size of one field
+ * @return the first field, the second one is area elements after it
+ */
+Real* createShared(Shared* s, const Chunk* c, size_t area)
+{
+    MPI_Group cart, node;
+    MPI_Aint size;
+    int unit, i;
+    char* raw;
+
+    MPI_Comm_split_type(c->comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &s->node);
+    MPI_Win_allocate_shared(2 * area * sizeof(Real) + ALIGN, sizeof(Real), MPI_INFO_NULL,
+                            s->node, &raw, &s->win);
+
+    /* Memory is mapped by pages, so alignment is the same in all threads */
+    s->base = (Real*)(raw + (ALIGN - (size_t)raw % ALIGN) % ALIGN);
+    touchField(s->base, c);
+    touchField(s->base + area, c);
+
+    s->ranks[0] = c->left;
+    s->ranks[1] = c->right;
+    s->ranks[2] = c->up;
+    s->ranks[3] = c->down;
+    MPI_Comm_group(c->comm, &cart);
+    MPI_Comm_group(s->node, &node);
+    for (i = 0; i < 4; ++i)
+    {
+        const int neighbour = s->ranks[i];
+        size_t y0, rows, x0, cols;
+        int peer = MPI_UNDEFINED;
+
+        s->peers[i] = NULL;
+        if (neighbour == MPI_PROC_NULL)
+            continue;
+        MPI_Group_translate_ranks(cart, 1, (int*)&neighbour, node, &peer);
+        if (peer == MPI_UNDEFINED)
+            continue;
+
+        MPI_Win_shared_query(s->win, peer, &size, &unit, &raw);
+        s->ranks[i] = MPI_PROC_NULL;
+        s->peers[i] = (Real*)(raw + (ALIGN - (size_t)raw % ALIGN) % ALIGN);
+        locate(c, neighbour, &y0, &rows, &x0, &cols);
+        s->ld[i] = rowLength(cols, c->H);
+        s->area[i] = (rows + 2 * c->H) * s->ld[i];
+
+        /* The last own columns of left neighbour, the first ones of right one, etc. */
+        s->offset[i] = i == 0 ? c->H * s->ld[i] + cols
+                     : i == 1 ? c->H * s->ld[i] + c->H
+                     : i == 2 ? rows * s->ld[i] : c->H * s->ld[i];
+    }
+    MPI_Group_free(&node);
+    MPI_Group_free(&cart);
+
+    /* Memory is accessed by loads and stores between synchronizations */
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, s->win);
+    return s->base;
+}
+
+/**
+ * Frees shared fields
+ * @param s shared fields
+ */
+void freeShared(Shared* s)
+{
+    MPI_Win_unlock_all(s->win);
+    MPI_Win_free(&s->win);
+    MPI_Comm_free(&s->node);
+}
+
+/**
+ * Prints amount of neighbours exchanging through shared memory by 0 thread
+ * @param s shared fields
+ * @param c chunk
+ */
+void reportShared(const Shared* s, const Chunk* c)
+{
+    int counts[2] = {0, 0}, total[2];
+    int rank, i;
+
+    for (i = 0; i < 4; ++i)
+    {
+        counts[0] += s->peers[i] != NULL;
+        counts[1] += s->peers[i] != NULL || s->ranks[i] != MPI_PROC_NULL;
+    }
+    MPI_Comm_rank(c->comm, &rank);
+    MPI_Reduce(counts, total, 2, MPI_INT, MPI_SUM, 0, c->comm);
+    if (!rank)
+        fprintf(stdout, "Halo in shared memory: %d of %d\n", total[0], total[1]);
+}
+
+/**
+ * Exchange through shared memory with neighbours of node and messages
+ * with others, the same as exchange()
+ * @param f exchanging field, one of two shared fields
+ * @param c chunk
+ * @param s shared fields
+ */
+void exchangeShared(Real* f, const Chunk* c, const Shared* s)
+{
+    const size_t ld = c->ld;
+    const size_t H = c->H;
+    const size_t second = f != s->base;
+    const Real* peers[4];
+    MPI_Request reqs[4];
+    size_t y;
+    int i;
+
+    for (i = 0; i < 4; ++i)
+        peers[i] = s->peers[i] ? s->peers[i] + second * s->area[i] + s->offset[i] : NULL;
+
+    /* Neighbours have finished the previous step */
+    syncShared(s);
+    MPI_Irecv(f + H * ld, 1, c->column, s->ranks[0], 0, c->comm, reqs);
+    MPI_Irecv(f + H * ld + H + c->cols, 1, c->column, s->ranks[1], 0, c->comm, reqs + 1);
+    MPI_Isend(f + H * ld + H, 1, c->column, s->ranks[0], 0, c->comm, reqs + 2);
+    MPI_Isend(f + H * ld + c->cols, 1, c->column, s->ranks[1], 0, c->comm, reqs + 3);
+    for (y = 0; y < c->rows; ++y)
+    {
+        if (peers[0])
+            memcpy(f + (H + y) * ld, peers[0] + y * s->ld[0], H * sizeof(Real));
+        if (peers[1])
+            memcpy(f + (H + y) * ld + H + c->cols, peers[1] + y * s->ld[1], H * sizeof(Real));
+    }
+    MPI_Waitall(4, reqs, MPI_STATUSES_IGNORE);
+
+    /* Neighbours have got their columns, so rows are copied with corners */
+    syncShared(s);
+    MPI_Irecv(f, 1, c->band, s->ranks[2], 0, c->comm, reqs);
+    MPI_Irecv(f + (H + c->rows) * ld, 1, c->band, s->ranks[3], 0, c->comm, reqs + 1);
+    MPI_Isend(f + H * ld, 1, c->band, s->ranks[2], 0, c->comm, reqs + 2);
+    MPI_Isend(f + c->rows * ld, 1, c->band, s->ranks[3], 0, c->comm, reqs + 3);
+    if (peers[2])
+        memcpy(f, peers[2], H * ld * sizeof(Real));
+    if (peers[3])
+        memcpy(f + (H + c->rows) * ld, peers[3], H * ld * sizeof(Real));
+    MPI_Waitall(4, reqs, MPI_STATUSES_IGNORE);
+
+    /* Wide steps write to exchanged field too, so neighbours should finish reading */
+    if (H > 1)
+        syncShared(s);
+}
+
+/*
+ * One-sided exchange: every thread puts its edges directly to halo of
+ * neighbours' windows, so there is no matching of sends and receives and
+ * no order of neighbours. Halo is put in two epochs, columns and then
+ * rows with corners, as in exchange(). Epochs are opened either by
+ * collective fences or by post/start/complete/wait with neighbours only.
+ */
+
+/**
+ * Windows of both fields for one-sided exchange
+ */
+typedef struct
+{
+    int fence;             /* Fence epochs instead of post/start/complete/wait */
+    Real* base[2];         /* Both fields, window is chosen by field */
+    MPI_Win win[2];
+    MPI_Group groups[2];   /* Neighbours by columns and by rows */
+    int ranks[4];          /* Left, right, up and down neighbours */
+    MPI_Aint disp[4];      /* Halo filled by current thread in neighbours' fields */
+    MPI_Datatype types[4];
+} Rma;
+
+/**
+ * Creates windows of both fields
+ * @param r created windows
+ * @param c chunk
+ * @param old the first field
+ * @param new the second field
+ * @param amount amount of cases, they follow each other in every field
+ * @param fence 1 for fence epochs, 0 for post/start/complete/wait ones
+ */
+void createRma(Rma* r, const Chunk* c, Real* old, Real* new, unsigned amount, int fence)
+{
+    const size_t H = c->H;
+    MPI_Group cart;
+    int i;
+
+    r->fence = fence;
+    r->base[0] = old;
+    r->base[1] = new;
+    for (i = 0; i < 2; ++i)
+        MPI_Win_create(r->base[i], amount * (c->rows + 2 * H) * c->ld * sizeof(Real),
+                       sizeof(Real), MPI_INFO_NULL, c->comm, r->win + i);
+
+    r->ranks[0] = c->left;
+    r->ranks[1] = c->right;
+    r->ranks[2] = c->up;
+    r->ranks[3] = c->down;
+    for (i = 0; i < 4; ++i)
+    {
+        size_t y0, rows, x0, cols, ld;
+        MPI_Datatype one;
+
+        r->types[i] = MPI_DATATYPE_NULL;
+        if (r->ranks[i] == MPI_PROC_NULL)
+            continue;
+        locate(c, r->ranks[i], &y0, &rows, &x0, &cols);
+        ld = rowLength(cols, H);
+
+        /* Right halo of left neighbour, left halo of right one, etc. */
+        r->disp[i] = i == 0 ? H * ld + H + cols
+                   : i == 1 ? H * ld
+                   : i == 2 ? (H + rows) * ld : 0;
+        if (i < 2)
+            MPI_Type_vector(rows, H, ld, REAL_MPI, &one);
+        else
+            MPI_Type_contiguous(H * ld, REAL_MPI, &one);
+        MPI_Type_create_hvector(amount, 1, (rows + 2 * H) * ld * sizeof(Real), one, r->types + i);
+        MPI_Type_commit(r->types + i);
+        MPI_Type_free(&one);
+    }
+
+    MPI_Comm_group(c->comm, &cart);
+    for (i = 0; i < 2; ++i)
+    {
+        int ranks[2], n = 0;
+        if (r->ranks[2 * i] != MPI_PROC_NULL)
+            ranks[n++] = r->ranks[2 * i];
+        if (r->ranks[2 * i + 1] != MPI_PROC_NULL)
+            ranks[n++] = r->ranks[2 * i + 1];
+        MPI_Group_incl(cart, n, ranks, r->groups + i);
+    }
+    MPI_Group_free(&cart);
+}
+
+/**
+ * Frees windows
+ * @param r windows
+ */
+void freeRma(Rma* r)
+{
+    int i;
+    for (i = 0; i < 2; ++i)
+    {
+        MPI_Win_free(r->win + i);
+        MPI_Group_free(r->groups + i);
+    }
+    for (i = 0; i < 4; ++i)
+        if (r->types[i] != MPI_DATATYPE_NULL)
+            MPI_Type_free(r->types + i);
+}
+
+/**
+ * Exchange by puts to neighbours' halo, the same as exchange()
+ * @param f exchanging field, one of two fields of windows
+ * @param c chunk
+ * @param r windows
+ */
+void exchangeRma(Real* f, const Chunk* c, const Rma* r)
+{
+    const size_t ld = c->ld;
+    const size_t H = c->H;
+    const MPI_Win win = r->win[f != r->base[0]];
+    Real* sends[4];
+    int half, i;
+
+    sends[0] = f + H * ld + H;
+    sends[1] = f + H * ld + c->cols;
+    sends[2] = f + H * ld;
+    sends[3] = f + c->rows * ld;
+
+    if (r->fence)
+        MPI_Win_fence(MPI_MODE_NOPRECEDE, win);
+
+    /* Columns, then rows with corners */
+    for (half = 0; half < 2; ++half)
+    {
+        if (!r->fence)
+        {
+            MPI_Win_post(r->groups[half], 0, win);
+            MPI_Win_start(r->groups[half], 0, win);
+        }
+        for (i = 2 * half; i < 2 * half + 2; ++i)
+            if (r->ranks[i] != MPI_PROC_NULL)
+                MPI_Put(sends[i], 1, half ? c->band : c->column, r->ranks[i],
+                        r->disp[i], 1, r->types[i], win);
+        if (r->fence)
+            MPI_Win_fence(half ? MPI_MODE_NOSUCCEED : 0, win);
+        else
+        {
+            MPI_Win_complete(win);
+            MPI_Win_wait(win);
+        }
+    }
+}
+
+/* One point of explicit scheme, order of operations is the same in all kernels,
+   it is counted in double even if points are stored in float */
+#define POINT(o, ld, th2) \
+    (*(o) + (- 4. * *(o) + *((o) - 1) + *((o) + 1) + *((o) - (ld)) + *((o) + (ld))) * (th2))
+
+/*
+ * Compact 9-point scheme is the product of 1D explicit steps by columns and rows:
+ *
+ *   new = (1 + th2 * Dxx) (1 + th2 * Dyy) old
+ *       = old + th2 * (Dxx + Dyy) old + th2 * th2 * Dxx Dyy old,
+ *
+ *             1 -2  1                .  1  .
+ *  Dxx Dyy = -2  4 -2,  Dxx + Dyy =  1 -4  1
+ *             1 -2  1                .  1  .
+ *
+ * With tau = h * h / 6 errors of time and space steps are cancelled up to
+ * the fourth order, as in the classic 1D scheme with the same tau.
+ * heat() reduces tau by O(h^4) to end exactly at T, it keeps the order.
+ * As the scheme reads corners, it needs halo with corners.
+ */
+#define POINT9(o, ld, th2) \
+    (*(o) + ((*((o) - 1) + *((o) + 1) + *((o) - (ld)) + *((o) + (ld)) - 4. * *(o)) \
+             + (*((o) - (ld) - 1) + *((o) - (ld) + 1) + *((o) + (ld) - 1) + *((o) + (ld) + 1) \
+                - 2. * (*((o) - 1) + *((o) + 1) + *((o) - (ld)) + *((o) + (ld))) + 4. * *(o)) \
+               * (th2)) * (th2))
+
+/**
+ * Kernel counting values in new layer from old layer in rectangle
+ * [y0, y1) * [x0, x1)
+ */
+typedef void (*Kernel)(double th2, const Real* old, Real* new, size_t ld,
+                       size_t y0, size_t y1, size_t x0, size_t x1);
+
+/* Kernel chosen at start up */
+static Kernel kernel;
+
+/* Non-temporal stores of new layer */
+static int nonTemporal;
+
+/**
+ * Counts values in new layer from old layer in rectangle [y0, y1) * [x0, x1)
+ * @param th2 tau div sqr h
+ * @param old old layer
+ * @param new new layer
+ * @param ld distance between rows
+ * @param y0 first counted row
+ * @param y1 row after the last counted one
+ * @param x0 first counted column
+ * @param x1 column after the last counted one
+*/
+void countScalar(double th2, const Real* old, Real* new, size_t ld,
+                 size_t y0, size_t y1, size_t x0, size_t x1)
+{
+    /* ________________|_##############_|_##############_|________________ */
+    size_t x, y;
+    const size_t columnsT = x1 - x0;
+    const ptrdiff_t diff = new - old; /* optimized memcpy style */
+    old += y0 * ld + x0;              /* first point */
+
+    if (y0 >= y1 || x0 >= x1)
+        return;
+
+    for (y = y0; y < y1; ++y, old += ld - columnsT) /* skip edges */
+        for (x = 0; x < columnsT; ++x, ++old)
+            *((Real*)old + diff) = POINT(old, ld, th2);
+}
+
+/**
+ * Compact fourth order counting kernel, see countScalar() and POINT9
+ */
+void countCompact(double th2, const Real* old, Real* new, size_t ld,
+                  size_t y0, size_t y1, size_t x0, size_t x1)
+{
+    size_t x, y;
+
+    for (y = y0; y < y1; ++y)
+    {
+        const Real* o = old + y * ld;
+        Real* n = new + y * ld;
+        for (x = x0; x < x1; ++x)
+            n[x] = POINT9(o + x, ld, th2);
+    }
+}
+
+#ifdef X86_KERNELS
+/*
+ * Vector kernels count row by row:
+ *
+ *   x0    aligned                      x1
+ *   |sss|vvvv|vvvv|vvvv|vvvv|vvvv|vvvv|ss|
+ *
+ * Points before the first aligned one and after the last full vector
+ * are counted by scalar code. As rows start at aligned addresses and
+ * old and new layers have the same layout, all loads except (x - 1)
+ * and (x + 1) ones are aligned.
+ * Float points are converted to double vectors and back.
+ */
+#ifdef SINGLE
+#   define SSE2_LOAD(p) _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(p))))
+#   define SSE2_LOADU(p) SSE2_LOAD(p)
+#   define SSE2_STORE(p, v) _mm_storel_epi64((__m128i*)(p), _mm_castps_si128(_mm_cvtpd_ps(v)))
+#   define SSE2_STREAM(p, v) SSE2_STORE(p, v) /* there is no 8 bytes stream */
+#   define AVX2_LOAD(p) _mm256_cvtps_pd(_mm_load_ps(p))
+#   define AVX2_LOADU(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+#   define AVX2_STORE(p, v) _mm_store_ps(p, _mm256_cvtpd_ps(v))
+#   define AVX2_STREAM(p, v) _mm_stream_ps(p, _mm256_cvtpd_ps(v))
+#   define AVX512_LOAD(p) _mm512_cvtps_pd(_mm256_load_ps(p))
+#   define AVX512_LOADU(p) _mm512_cvtps_pd(_mm256_loadu_ps(p))
+#   define AVX512_STORE(p, v) _mm256_store_ps(p, _mm512_cvtpd_ps(v))
+#   define AVX512_STREAM(p, v) _mm256_stream_ps(p, _mm512_cvtpd_ps(v))
+#else
+#   define SSE2_LOAD(p) _mm_load_pd(p)
+#   define SSE2_LOADU(p) _mm_loadu_pd(p)
+#   define SSE2_STORE(p, v) _mm_store_pd(p, v)
+#   define SSE2_STREAM(p, v) _mm_stream_pd(p, v)
+#   define AVX2_LOAD(p) _mm256_load_pd(p)
+#   define AVX2_LOADU(p) _mm256_loadu_pd(p)
+#   define AVX2_STORE(p, v) _mm256_store_pd(p, v)
+#   define AVX2_STREAM(p, v) _mm256_stream_pd(p, v)
+#   define AVX512_LOAD(p) _mm512_load_pd(p)
+#   define AVX512_LOADU(p) _mm512_loadu_pd(p)
+#   define AVX512_STORE(p, v) _mm512_store_pd(p, v)
+#   define AVX512_STREAM(p, v) _mm512_stream_pd(p, v)
+#endif
+
+/**
+ * SSE2 counting kernel, see countScalar()
+ */
+__attribute__((target("sse2")))
+void countSSE2(double th2, const Real* old, Real* new, size_t ld,
+               size_t y0, size_t y1, size_t x0, size_t x1)
+{
+    const __m128d m4 = _mm_set1_pd(-4.);
+    const __m128d t = _mm_set1_pd(th2);
+    size_t x, y;
+
+    for (y = y0; y < y1; ++y)
+    {
+        const Real* o = old + y * ld;
+        Real* n = new + y * ld;
+        for (x = x0; x < x1 && (size_t)(n + x) % 16; ++x)
+            n[x] = POINT(o + x, ld, th2);
+        for (; x + 2 <= x1; x += 2)
+        {
+            const __m128d c = SSE2_LOAD(o + x);
+            __m128d v = _mm_mul_pd(m4, c);
+            v = _mm_add_pd(v, SSE2_LOADU(o + x - 1));
+            v = _mm_add_pd(v, SSE2_LOADU(o + x + 1));
+            v = _mm_add_pd(v, SSE2_LOAD(o + x - ld));
+            v = _mm_add_pd(v, SSE2_LOAD(o + x + ld));
+            v = _mm_add_pd(c, _mm_mul_pd(v, t));
+            if (nonTemporal)
+                SSE2_STREAM(n + x, v);
+            else
+                SSE2_STORE(n + x, v);
+        }
+        for (; x < x1; ++x)
+            n[x] = POINT(o + x, ld, th2);
+    }
+    if (nonTemporal)
+        _mm_sfence();
+}
+
+/**
+ * AVX2 counting kernel, see countScalar()
+ */
+__attribute__((target("avx2")))
+void countAVX2(double th2, const Real* old, Real* new, size_t ld,
+               size_t y0, size_t y1, size_t x0, size_t x1)
+{
+    const __m256d m4 = _mm256_set1_pd(-4.);
+    const __m256d t = _mm256_set1_pd(th2);
+    size_t x, y;
+
+    for (y = y0; y < y1; ++y)
+    {
+        const Real* o = old + y * ld;
+        Real* n = new + y * ld;
+        for (x = x0; x < x1 && (size_t)(n + x) % 32; ++x)
+            n[x] = POINT(o + x, ld, th2);
+        for (; x + 4 <= x1; x += 4)
+        {
+            const __m256d c = AVX2_LOAD(o + x);
+            __m256d v = _mm256_mul_pd(m4, c);
+            v = _mm256_add_pd(v, AVX2_LOADU(o + x - 1));
+            v = _mm256_add_pd(v, AVX2_LOADU(o + x + 1));
+            v = _mm256_add_pd(v, AVX2_LOAD(o + x - ld));
+            v = _mm256_add_pd(v, AVX2_LOAD(o + x + ld));
+            v = _mm256_add_pd(c, _mm256_mul_pd(v, t));
+            if (nonTemporal)
+                AVX2_STREAM(n + x, v);
+            else
+                AVX2_STORE(n + x, v);
+        }
+        for (; x < x1; ++x)
+            n[x] = POINT(o + x, ld, th2);
+    }
+    if (nonTemporal)
+        _mm_sfence();
+}
+
+/**
+ * AVX-512 counting kernel, see countScalar()
+ */
+__attribute__((target("avx512f")))
+void countAVX512(double th2, const Real* old, Real* new, size_t ld,
+                 size_t y0, size_t y1, size_t x0, size_t x1)
+{
+    const __m512d m4 = _mm512_set1_pd(-4.);
+    const __m512d t = _mm512_set1_pd(th2);
+    size_t x, y;
+
+    for (y = y0; y < y1; ++y)
+    {
+        const Real* o = old + y * ld;
+        Real* n = new + y * ld;
+        for (x = x0; x < x1 && (size_t)(n + x) % 64; ++x)
+            n[x] = POINT(o + x, ld, th2);
+        for (; x + 8 <= x1; x += 8)
+        {
+            const __m512d c = AVX512_LOAD(o + x);
+            __m512d v = _mm512_mul_pd(m4, c);
+            v = _mm512_add_pd(v, AVX512_LOADU(o + x - 1));
+            v = _mm512_add_pd(v, AVX512_LOADU(o + x + 1));
+            v = _mm512_add_pd(v, AVX512_LOAD(o + x - ld));
+            v = _mm512_add_pd(v, AVX512_LOAD(o + x + ld));
+            v = _mm512_add_pd(c, _mm512_mul_pd(v, t));
+            if (nonTemporal)
+                AVX512_STREAM(n + x, v);
+            else
+                AVX512_STORE(n + x, v);
+        }
+        for (; x < x1; ++x)
+            n[x] = POINT(o + x, ld, th2);
+    }
+    if (nonTemporal)
+        _mm_sfence();
+}
+#endif
+
+/**
+ * Chooses counting kernel and vector exponent of fill() of the same width
+ * @param name name of kernel, NULL for the best supported one
+ * @param nt 1 for non-temporal stores
+ * @return name of chosen kernel, NULL if it is not supported
+ */
+const char* chooseKernel(const char* name, int nt)
+{
+    nonTemporal = nt;
+    kernel = countScalar;
+    exponent = expScalar;
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (!name || !strcmp(name, "avx2")
+                                           || !strcmp(name, "avx512")))
+        exponent = expAVX2;
+    if (name ? !strcmp(name, "avx512") : __builtin_cpu_supports("avx512f"))
+    {
+        kernel = countAVX512;
+        return __builtin_cpu_supports("avx512f") ? "avx512" : NULL;
+    }
+    if (name ? !strcmp(name, "avx2") : __builtin_cpu_supports("avx2"))
+    {
+        kernel = countAVX2;
+        return __builtin_cpu_supports("avx2") ? "avx2" : NULL;
+    }
+    if (name ? !strcmp(name, "sse2") : __builtin_cpu_supports("sse2"))
+    {
+        kernel = countSSE2;
+        return __builtin_cpu_supports("sse2") ? "sse2" : NULL;
+    }
+#endif
+    return (!name || !strcmp(name, "scalar")) ? "scalar" : NULL;
+}
+
+/**
+ * Counts values in new layer from old layer in rectangle [y0, y1) * [x0, x1)
+ * with chosen kernel
+ * @param th2 tau div sqr h
+ * @param old old layer
+ * @param new new layer
+ * @param ld distance between rows
+ * @param y0 first counted row
+ * @param y1 row after the last counted one
+ * @param x0 first counted column
+ * @param x1 column after the last counted one
+*/
+void countRect(double th2, Real* old, Real* new, size_t ld,
+               size_t y0, size_t y1, size_t x0, size_t x1)
+{
+#ifdef _OPENMP
+    /* Rows are split between threads in the same way as in touchField() */
+    long y;
+
+    if (y0 >= y1 || x0 >= x1)
+        return;
+
+#pragma omp parallel for schedule(static) if ((y1 - y0) * (x1 - x0) >= PARALLEL_MIN)
+    for (y = y0; y < (long)y1; ++y)
+        kernel(th2, old, new, ld, y, y + 1, x0, x1);
+#else
+    if (y0 < y1 && x0 < x1)
+        kernel(th2, old, new, ld, y0, y1, x0, x1);
+#endif
+}
+
+/**
+ * Counts values in new layer from old layer
+ * @param th2 tau div sqr h
+ * @param old old layer
+ * @param new new layer
+ * @param c chunk
+*/
+void count(double th2, Real* old, Real* new, const Chunk* c)
+{
+    countRect(th2, old, new, c->ld, c->ylo, c->yhi, c->xlo, c->xhi);
+}
+
+/**
+ * Counts change of field in one step in the whole grid
+ * @param old old layer
+ * @param new new layer
+ * @param c chunk
+ * @return maximum of |new - old| in counted points
+ */
+double change(const Real* old, const Real* new, const Chunk* c)
+{
+    const long y0 = c->ylo;
+    const long y1 = c->yhi;
+    double local = 0.;
+    double global;
+    long y;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(max: local)
+#endif
+    for (y = y0; y < y1; ++y)
+    {
+        size_t x;
+        for (x = c->xlo; x < c->xhi; ++x)
+        {
+            const double d = fabs((double)new[y * c->ld + x] - old[y * c->ld + x]);
+            if (d > local)
+                local = d;
+        }
+    }
+
+    MPI_Allreduce(&local, &global, 1, MPI_DOUBLE, MPI_MAX, c->comm);
+    return global;
+}
+
+/**
+ * Counts in-situ statistics of the whole grid, 0 thread prints them:
+ * total heat (integral of field), maximum, minimum and centroid of heat
+ * @param f field
+ * @param c chunk
+ * @param step number of step
+ */
+void statistics(const Real* f, const Chunk* c, unsigned step)
+{
+    const double h = 1. / (c->N - 1);
+    const long y0 = c->H;
+    const long y1 = c->H + c->rows;
+    double sums[3] = {0., 0., 0.}; /* heat, its moments by x and by y */
+    double global[3];
+    double sum = 0., sx = 0., sy = 0.;
+    double high = f[c->H * c->ld + c->H];
+    double low = high;
+    int rank;
+    long y;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+: sum, sx, sy) reduction(max: high) reduction(min: low)
+#endif
+    for (y = y0; y < y1; ++y)
+    {
+        const double gy = (double)(c->y0 + y - c->H);
+        size_t x;
+        for (x = c->H; x < c->H + c->cols; ++x)
+        {
+            const double v = f[y * c->ld + x];
+            sum += v;
+            sx += v * (double)(c->x0 + x - c->H);
+            sy += v * gy;
+            if (v > high)
+                high = v;
+            if (v < low)
+                low = v;
+        }
+    }
+    sums[0] = sum;
+    sums[1] = sx;
+    sums[2] = sy;
+
+    MPI_Comm_rank(c->comm, &rank);
+    MPI_Reduce(sums, global, 3, MPI_DOUBLE, MPI_SUM, 0, c->comm);
+    MPI_Reduce(rank ? &high : MPI_IN_PLACE, &high, 1, MPI_DOUBLE, MPI_MAX, 0, c->comm);
+    MPI_Reduce(rank ? &low : MPI_IN_PLACE, &low, 1, MPI_DOUBLE, MPI_MIN, 0, c->comm);
+    if (!rank)
+        fprintf(stdout, "Step %u: heat %.9f, max %.6f, min %.6f, centroid (%.6f, %.6f)\n",
+                step, global[0] * h * h, high, low,
+                global[1] / global[0] * h, global[2] / global[0] * h);
+}
+
+/**
+ * Counts values in new layer from old layer in counted rectangle widened
+ * towards neighbours
+ * @param th2 tau div sqr h
+ * @param old old layer
+ * @param new new layer
+ * @param c chunk
+ * @param w amount of halo lines to count
+*/
+void countWide(double th2, Real* old, Real* new, const Chunk* c, size_t w)
+{
+    countRect(th2, old, new, c->ld,
+              c->ylo - w * (c->up   != MPI_PROC_NULL),
+              c->yhi + w * (c->down != MPI_PROC_NULL),
+              c->xlo - w * (c->left != MPI_PROC_NULL),
+              c->xhi + w * (c->right != MPI_PROC_NULL));
+}
+
+/*
+ * Time skewing.
+ * Steps between exchanges may be made tile by tile, so tile of rows
+ * stays in cache while it is counted several times. Tile of every next
+ * step is shifted back by one row, as the next step needs rows around:
+ *
+ *       tile 0  tile 1  tile 2
+ * step 3 |###|###|###|###|###|
+ * step 2  |###|###|###|###|###|
+ * step 1   |###|###|###|###|###|
+ *         rows ->
+ *
+ * Only two layers are needed: step j + 1 overwrites row y of step j - 1
+ * after rows y - 1, y, y + 1 of step j are counted from it.
+ */
+/**
+ * Makes n steps between exchanges, widened like in countWide(), tile by tile
+ * @param th2 tau div sqr h
+ * @param old old layer, it has result if n is even
+ * @param new new layer, it has result if n is odd
+ * @param c chunk
+ * @param n amount of steps, not more than halo width
+ * @param tile amount of rows in tile
+ */
+void countTiled(double th2, Real* old, Real* new, const Chunk* c,
+                size_t n, size_t tile)
+{
+    const size_t wide = c->H - 1; /* widening on the first step */
+    const size_t up = c->up != MPI_PROC_NULL;
+    const size_t down = c->down != MPI_PROC_NULL;
+    const size_t left = c->left != MPI_PROC_NULL;
+    const size_t right = c->right != MPI_PROC_NULL;
+    const size_t top = c->ylo - wide * up;
+    const size_t bottom = c->yhi + wide * down;
+    size_t r, j;
+
+    for (r = top; r < bottom + n - 1; r += tile)
+        for (j = 0; j < n && j < r + tile; ++j)
+        {
+            const size_t w = wide - j;
+            const size_t lo = c->ylo - w * up;
+            const size_t hi = c->yhi + w * down;
+            const size_t y0 = r > lo + j ? r - j : lo;
+            const size_t y1 = r + tile < hi + j ? r + tile - j : hi;
+
+            countRect(th2, j % 2 ? new : old, j % 2 ? old : new, c->ld, y0, y1,
+                      c->xlo - w * left, c->xhi + w * right);
+        }
+}
+
+/**
+ * Exchanges edges of old layer and counts new layer simultaneously:
+ * inner points are counted while edges are travelling,
+ * points next to received vectors are counted after exchange is finished.
+ * @param th2 tau div sqr h
+ * @param old old layer
+ * @param new new layer
+ * @param c chunk
+ * @param persistent persistent requests of old layer exchange without
+ *                   corners, NULL to start new ones
+ * @return time spent in exchange
+ */
+double countOverlapped(double th2, Real* old, Real* new, const Chunk* c,
+                       MPI_Request* persistent)
+{
+    MPI_Request started[8];
+    MPI_Request* const reqs = persistent ? persistent : started;
+    double time = -MPI_Wtime();
+
+    /* Inner rectangle does not touch halo of width 1 */
+    const size_t y0 = c->ylo > 2 ? c->ylo : 2;
+    const size_t y1 = c->yhi < c->rows ? c->yhi : c->rows;
+    const size_t x0 = c->xlo > 2 ? c->xlo : 2;
+    const size_t x1 = c->xhi < c->cols ? c->xhi : c->cols;
+
+    if (persistent)
+        MPI_Startall(8, persistent);
+    else
+        exchangeRequests(old, c, 0, 0, started);
+    time += MPI_Wtime();
+
+    if (y0 >= y1 || x0 >= x1)
+    {
+        time -= MPI_Wtime();
+        MPI_Waitall(8, reqs, MPI_STATUSES_IGNORE);
+        time += MPI_Wtime();
+        count(th2, old, new, c);
+        return time;
+    }
+
+    countRect(th2, old, new, c->ld, y0, y1, x0, x1);
+
+    time -= MPI_Wtime();
+    MPI_Waitall(8, reqs, MPI_STATUSES_IGNORE);
+    time += MPI_Wtime();
+
+    /* Frame around inner rectangle */
+    countRect(th2, old, new, c->ld, c->ylo, y0, c->xlo, c->xhi);
+    countRect(th2, old, new, c->ld, y1, c->yhi, c->xlo, c->xhi);
+    countRect(th2, old, new, c->ld, y0, y1, c->xlo, x0);
+    countRect(th2, old, new, c->ld, y0, y1, x1, c->xhi);
+    return time;
+}
+
+/*
+ * Threads may count with different speed, e.g. on nodes of different
+ * generations, and the slowest one sets the pace of every step.
+ * So rows of grid may be split between rows of Cartesian grid of threads
+ * in proportion to their measured speed. Row of threads is as fast as its
+ * slowest thread, and columns are still split evenly:
+ *
+ *  fast |aaaa|bbbb|cccc|
+ *       |aaaa|bbbb|cccc|
+ *       |aaaa|bbbb|cccc|
+ *  slow |dddd|eeee|ffff|
+ */
+
+/**
+ * Measures speed of counting of current thread
+ * @param th2 tau div sqr h
+ * @param a alpha parameter of input function
+ * @param b beta parameter of input function
+ * @param c chunk
+ * @param steps amount of measured steps
+ * @return own points per second
+ */
+double calibrate(double th2, double a, double b, const Chunk* c, unsigned steps)
+{
+    const size_t area = (c->rows + 2 * c->H) * c->ld;
+    Real* old = allocField(area);
+    Real* new = allocField(area);
+    double time;
+    unsigned i;
+
+    touchField(old, c);
+    touchField(new, c);
+    fill(old, a, b, c);
+
+    /* The first step brings field to cache and is not measured */
+    count(th2, old, new, c);
+    time = -MPI_Wtime();
+    for (i = 0; i < steps; ++i)
+        count(th2, i % 2 ? new : old, i % 2 ? old : new, c);
+    time += MPI_Wtime();
+
+    freeField(new);
+    freeField(old);
+    return (double)c->rows * c->cols * steps / (time > MPI_Wtick() ? time : MPI_Wtick());
+}
+
+/**
+ * Splits rows of grid between rows of threads in proportion to their speed
+ * Every row of threads keeps at least H rows to fill halo of neighbours.
+ * @param c chunk
+ * @param speed own points per second of current thread
+ * @return first rows of rows of threads and N, should be freed
+ */
+size_t* weighRows(const Chunk* c, double speed)
+{
+    const size_t extra = c->N - c->dims[0] * c->H;
+    size_t* bounds = (size_t*)malloc((c->dims[0] + 1) * sizeof(size_t));
+    double* rowTimes = (double*)calloc(c->dims[0], sizeof(double));
+    double* speeds;
+    double total = 0., sum = 0.;
+    int size, r;
+
+    MPI_Comm_size(c->comm, &size);
+    speeds = (double*)malloc(size * sizeof(double));
+    MPI_Allgather(&speed, 1, MPI_DOUBLE, speeds, 1, MPI_DOUBLE, c->comm);
+
+    /* Time of one grid row in every row of threads */
+    for (r = 0; r < size; ++r)
+    {
+        int coords[2];
+        size_t y0, rows, x0, cols;
+
+        MPI_Cart_coords(c->comm, r, 2, coords);
+        locate(c, r, &y0, &rows, &x0, &cols);
+        if (cols / speeds[r] > rowTimes[coords[0]])
+            rowTimes[coords[0]] = cols / speeds[r];
+    }
+    for (r = 0; r < c->dims[0]; ++r)
+        total += 1. / rowTimes[r];
+
+    bounds[0] = 0;
+    for (r = 0; r < c->dims[0]; ++r)
+    {
+        sum += 1. / rowTimes[r];
+        bounds[r + 1] = (r + 1) * c->H + (size_t)(extra * sum / total + .5);
+    }
+    bounds[c->dims[0]] = c->N;
+
+    free(speeds);
+    free(rowTimes);
+    return bounds;
+}
+
+/**
+ * Prints amount of rows of every row of threads by 0 thread
+ * @param c chunk
+ */
+void reportRows(const Chunk* c)
+{
+    int rank, r;
+
+    MPI_Comm_rank(c->comm, &rank);
+    if (rank || !c->bounds)
+        return;
+    fprintf(stdout, "Rows of threads:");
+    for (r = 0; r < c->dims[0]; ++r)
+        fprintf(stdout, " %lu", (unsigned long)(c->bounds[r + 1] - c->bounds[r]));
+    fprintf(stdout, "\n");
+}
+
+/**
+ * Replaces chunk with chunk of another split of rows between the same threads
+ * @param c chunk
+ * @param bounds first rows of rows of threads and N
+ */
+void resplit(Chunk* c, const size_t* bounds)
+{
+    Chunk next;
+
+    /* Rows of threads are kept, so dims are the same */
+    createChunk(&next, c->N, c->dims[1] == 1, c->H, c->comm, bounds);
+    freeChunk(c);
+    *c = next;
+}
+
+/**
+ * Moves own points of field to chunks of another split of rows
+ * Columns are split in the same way, so points move inside columns of threads.
+ * @param f field of current chunk
+ * @param from current chunk
+ * @param to chunk of another split, the same threads have the same ranks
+ * @return field of new chunk, should be freed by freeField()
+ */
+Real* moveRows(const Real* f, const Chunk* from, const Chunk* to)
+{
+    Real* moved = allocField((to->rows + 2 * to->H) * to->ld);
+    MPI_Request* reqs;
+    MPI_Datatype* types;
+    int size, r, k = 0;
+
+    touchField(moved, to);
+    MPI_Comm_size(from->comm, &size);
+    reqs = (MPI_Request*)malloc(2 * size * sizeof(MPI_Request));
+    types = (MPI_Datatype*)malloc(2 * size * sizeof(MPI_Datatype));
+
+    for (r = 0; r < size; ++r)
+    {
+        size_t y0, rows, x0, cols, ny0, nrows, lo, hi;
+
+        locate(from, r, &y0, &rows, &x0, &cols);
+        if (x0 != from->x0)
+            continue;
+        locate(to, r, &ny0, &nrows, &x0, &cols);
+
+        /* Own rows which are rows of thread r in new split */
+        lo = from->y0 > ny0 ? from->y0 : ny0;
+        hi = from->y0 + from->rows < ny0 + nrows ? from->y0 + from->rows : ny0 + nrows;
+        if (lo < hi)
+        {
+            MPI_Type_vector(hi - lo, cols, from->ld, REAL_MPI, types + k);
+            MPI_Type_commit(types + k);
+            MPI_Isend((void*)(f + (from->H + lo - from->y0) * from->ld + from->H), 1,
+                      types[k], r, 0, from->comm, reqs + k);
+            ++k;
+        }
+
+        /* Rows of thread r which are own rows in new split */
+        lo = to->y0 > y0 ? to->y0 : y0;
+        hi = to->y0 + to->rows < y0 + rows ? to->y0 + to->rows : y0 + rows;
+        if (lo < hi)
+        {
+            MPI_Type_vector(hi - lo, cols, to->ld, REAL_MPI, types + k);
+            MPI_Type_commit(types + k);
+            MPI_Irecv(moved + (to->H + lo - to->y0) * to->ld + to->H, 1,
+                      types[k], r, 0, from->comm, reqs + k);
+            ++k;
+        }
+    }
+    MPI_Waitall(k, reqs, MPI_STATUSES_IGNORE);
+
+    for (r = 0; r < k; ++r)
+        MPI_Type_free(types + r);
+    free(types);
+    free(reqs);
+    return moved;
+}
+
+/**
+ * Splits rows again if the slowest thread is much more busy than average one
+ * @param c chunk, it is replaced if rows are moved
+ * @param f field, it is replaced if rows are moved
+ * @param busy time of counting since the previous check
+ * @param steps amount of steps since the previous check
+ * @param threshold allowed excess of maximal busy time over average one
+ * @return 1 if rows are moved, 0 otherwise
+ */
+int rebalance(Chunk* c, Real** f, double busy, unsigned steps, double threshold)
+{
+    double maxBusy, sumBusy;
+    size_t* bounds;
+    Chunk next;
+    Real* moved;
+    int size;
+
+    MPI_Comm_size(c->comm, &size);
+    MPI_Allreduce(&busy, &maxBusy, 1, MPI_DOUBLE, MPI_MAX, c->comm);
+    MPI_Allreduce(&busy, &sumBusy, 1, MPI_DOUBLE, MPI_SUM, c->comm);
+    if (maxBusy <= (1. + threshold) * sumBusy / size)
+        return 0;
+
+    busy = busy > MPI_Wtick() ? busy : MPI_Wtick();
+    bounds = weighRows(c, (double)c->rows * c->cols * steps / busy);
+    createChunk(&next, c->N, c->dims[1] == 1, c->H, c->comm, bounds);
+    free(bounds);
+
+    moved = moveRows(*f, c, &next);
+    freeField(*f);
+    freeChunk(c);
+    *f = moved;
+    *c = next;
+    return 1;
+}
+
 /*
- * The whole grid will be split at chunks to every thread.
- * Structure of the chunk is following:
- *
- * rank == 0:
- *
- * |@@@@@@@@@@@@|
- * |@   DATA   @|
- * |@__________@| @ is for edges, which are not counted
- *  ************   <- vector from next thread
- *
- * rank != 0 && rank != size - 1:
+ * Implicit ADI (Peaceman-Rachford) integrator makes step of tau in two halves.
+ * The first half is implicit by rows and explicit by columns, the second
+ * one is vice versa. With rho = tau / (2 * h * h):
  *
- *  ************  <- vector from previous thread
- * |@          @|
- * |@   DATA   @|
- * |@          @|
- *  ************  <- vector from next thread
+ *  (1 + 2 rho) u*[x] - rho (u*[x - 1] + u*[x + 1])
+ *              = (1 - 2 rho) u[y] + rho (u[y - 1] + u[y + 1])
  *
- * rank == size - 1:
+ * It is stable for any tau, so steps may be much larger than h * h / 4.
+ * Every implicit half is a tridiagonal system on the whole grid line, but
+ * lines are split between threads of one row (or column) of Cartesian grid.
+ * So threads exchange own points with each other, every one gets
+ * some whole lines, solves them and returns them back:
  *
- *  ************  <- vector from previous thread
- * |@          @|
- * |@   DATA   @|
- * |@@@@@@@@@@@@|
+ *  |aaaa|bbbb|cccc|      |aaaabbbbcccc| <- thread 0
+ *  |aaaa|bbbb|cccc|  ->  |aaaabbbbcccc| <- thread 1
+ *  |aaaa|bbbb|cccc|      |aaaabbbbcccc| <- thread 2
+ *  |aaaa|bbbb|cccc|      |aaaabbbbcccc|
  *
- * As you can see, in every chunk we should make calculations only in inner
- * rectangle.
+ * Columns are transposed on the fly by datatypes, so every line is
+ * contiguous in memory.
  */
 
 /**
- * Scatters grid to threads with minimal recip
- * @param N grid size
- * @param sendcl size of grid sent to every thread
- * @param destcl offset for every thread
- * @param size mpi size
+ * Whole grid lines of thread for implicit counting
  */
-void scatter(unsigned N, int* sendcl, int* destcl, int size)
+typedef struct
 {
-    /* Grid is scattered to threads in this way:
-    `*                    |-> amount == 6
-     * 0:  0  1  2  3  4  5
-     * 1:  6  7  8  9 10 11
-     * 2: 12 13 14 15 16 17
-     * 3: 18 19 20 21 22 23 24 <- resRank
-     * 4: 25 26 27 28 29 30 31
-     */
-    size_t resRank = size - N % size;
-    size_t amount = N / size;
-    
-    /* Give rectangled */
-    size_t i = 0;
-    for (; i < resRank; ++i)
-        *sendcl++ = N * amount;
+    MPI_Comm comm;            /* Threads of one row or column of Cartesian grid */
+    size_t first, amount;     /* First own line in chunk and amount of lines */
+    Real* lines;            /* Whole lines one after another */
+    int* fieldCounts;         /* 0 or 1 datatype for every thread */
+    int* lineCounts;
+    int* fieldDispls;         /* Displacements in bytes */
+    int* lineDispls;
+    MPI_Datatype* fieldTypes; /* Points of thread lines in chunk with halo */
+    MPI_Datatype* lineTypes;  /* Points of thread chunk in lines */
+    MPI_Request* reqs;        /* Receives and sends of transposition */
+} Lines;
 
-    /* Split recip to the bottom threads */
-    ++amount;
-    for (; i < size; ++i)
-        *sendcl++ = N * amount;
+/**
+ * Creates lines of thread
+ * @param l created lines
+ * @param c chunk
+ * @param rows 1 for rows of grid, 0 for columns
+ */
+void createLines(Lines* l, const Chunk* c, int rows)
+{
+    const size_t own = rows ? c->rows : c->cols;
+    int remain[2];
+    int size, me, k;
+
+    remain[0] = !rows;
+    remain[1] = rows;
+    MPI_Cart_sub(c->comm, remain, &l->comm);
+    MPI_Comm_size(l->comm, &size);
+    MPI_Comm_rank(l->comm, &me);
+
+    l->amount = scatter(own, size, me, &l->first);
+    l->lines = allocField(l->amount * c->N);
+    l->fieldCounts = (int*)malloc(size * sizeof(int));
+    l->lineCounts = (int*)malloc(size * sizeof(int));
+    l->fieldDispls = (int*)malloc(size * sizeof(int));
+    l->lineDispls = (int*)malloc(size * sizeof(int));
+    l->fieldTypes = (MPI_Datatype*)malloc(size * sizeof(MPI_Datatype));
+    l->lineTypes = (MPI_Datatype*)malloc(size * sizeof(MPI_Datatype));
+    l->reqs = (MPI_Request*)malloc(2 * size * sizeof(MPI_Request));
+
+    for (k = 0; k < size; ++k)
+    {
+        int coords[2], rank;
+        size_t y0, prows, x0, pcols, first;
+        const size_t amount = scatter(own, size, k, &first);
 
-    sendcl -= size;
-    /* Fill offsets for every thread */
-    *(destcl++) = 0;
-    for (i = 1; i < size; ++i, ++destcl)
-        *destcl = *(destcl - 1) + *(sendcl++);
+        coords[0] = rows ? c->coords[0] : k;
+        coords[1] = rows ? k : c->coords[1];
+        MPI_Cart_rank(c->comm, coords, &rank);
+        locate(c, rank, &y0, &prows, &x0, &pcols);
+
+        /* Lines of k-th thread are sent to it, points of its chunk come back */
+        l->fieldCounts[k] = amount > 0;
+        l->lineCounts[k] = l->amount > 0;
+        l->fieldTypes[k] = l->lineTypes[k] = REAL_MPI;
+        if (rows)
+        {
+            l->fieldDispls[k] = ((c->H + first) * c->ld + c->H) * sizeof(Real);
+            l->lineDispls[k] = x0 * sizeof(Real);
+            if (amount)
+                MPI_Type_vector(amount, c->cols, c->ld, REAL_MPI, l->fieldTypes + k);
+            if (l->amount)
+                MPI_Type_vector(l->amount, pcols, c->N, REAL_MPI, l->lineTypes + k);
+        }
+        else
+        {
+            l->fieldDispls[k] = (c->H * c->ld + c->H + first) * sizeof(Real);
+            l->lineDispls[k] = y0 * sizeof(Real);
+            if (amount)
+                MPI_Type_vector(c->rows, amount, c->ld, REAL_MPI, l->fieldTypes + k);
+            if (l->amount)
+            {
+                /* Point of all lines, then the next one, i.e. transposition */
+                MPI_Datatype point, resized;
+                MPI_Type_vector(l->amount, 1, c->N, REAL_MPI, &point);
+                MPI_Type_create_resized(point, 0, sizeof(Real), &resized);
+                MPI_Type_contiguous(prows, resized, l->lineTypes + k);
+                MPI_Type_free(&point);
+                MPI_Type_free(&resized);
+            }
+        }
+        if (amount)
+            MPI_Type_commit(l->fieldTypes + k);
+        if (l->amount)
+            MPI_Type_commit(l->lineTypes + k);
+    }
 }
 
 /**
- * Prints square matrix from linear data array
- * @param f printed field
- * @param N size of row
- * @param rows amount of rows
+ * Frees lines resources
+ * @param l lines
  */
-void print(const double* f, size_t N, size_t rows)
+void freeLines(Lines* l)
 {
-    FILE* fp = fopen(FILENAME, "w");
-    size_t x, y;
+    int size, k;
 
-    for (y = 0; y < rows; ++y)
+    MPI_Comm_size(l->comm, &size);
+    for (k = 0; k < size; ++k)
     {
-        for (x = 0; x < N; ++x)
-            fprintf(fp, "%8.3f\t", *(f++));
-        fprintf(fp, "\n");
+        if (l->fieldCounts[k])
+            MPI_Type_free(l->fieldTypes + k);
+        if (l->lineCounts[k])
+            MPI_Type_free(l->lineTypes + k);
     }
-    fclose(fp);
+    free(l->fieldCounts);
+    free(l->lineCounts);
+    free(l->fieldDispls);
+    free(l->lineDispls);
+    free(l->fieldTypes);
+    free(l->lineTypes);
+    free(l->reqs);
+    freeField(l->lines);
+    MPI_Comm_free(&l->comm);
 }
 
 /**
- * Fills field with initial values
- * @param f filling field
- * @param a alpha parameter of input function
- * @param b beta parameter of input function
- * @param N grid density
+ * Moves own points of chunk to whole lines or back
+ * @param f chunk with halo
+ * @param l lines
+ * @param back 0 to fill lines, 1 to return them to chunk
+ * @return time of moving
  */
-void fill(double* f, double a, double b, size_t N)
+double transpose(Real* f, Lines* l, int back)
 {
-    size_t x, y;
-    /* Exponent multiplier */
-    double multiplier = ((N - 1) * a);
-    multiplier *= multiplier;
-    multiplier = - 1. / multiplier;
+    /* It is MPI_Alltoallw, but Open MPI 4.1 fails to copy such types to itself */
+    char* const field = (char*)f;
+    char* const lines = (char*)l->lines;
+    double time = -MPI_Wtime();
+    int size, k;
 
-    for (y = 0; y < N; ++y)
-        for (x = 0; x < N; ++x)
-            *(f++) = exp(multiplier * (x * x - 2 * b * x * y + y * y));
+    MPI_Comm_size(l->comm, &size);
+    for (k = 0; k < size; ++k)
+        if (back)
+            MPI_Irecv(field + l->fieldDispls[k], l->fieldCounts[k], l->fieldTypes[k],
+                      k, 0, l->comm, l->reqs + k);
+        else
+            MPI_Irecv(lines + l->lineDispls[k], l->lineCounts[k], l->lineTypes[k],
+                      k, 0, l->comm, l->reqs + k);
+    for (k = 0; k < size; ++k)
+        if (back)
+            MPI_Isend(lines + l->lineDispls[k], l->lineCounts[k], l->lineTypes[k],
+                      k, 0, l->comm, l->reqs + size + k);
+        else
+            MPI_Isend(field + l->fieldDispls[k], l->fieldCounts[k], l->fieldTypes[k],
+                      k, 0, l->comm, l->reqs + size + k);
+    MPI_Waitall(2 * size, l->reqs, MPI_STATUSES_IGNORE);
+    return time += MPI_Wtime();
 }
 
 /**
- * Copy edges from one field to another
- * N.B. that edges are not changed after this copy.
- * @param old old field
- * @param new new field
- * @param N size of row
- * @param rows amount of rows
+ * Solves tridiagonal system with cyclic reduction, as in lobanov1.c:
+ * a[i] * y[i - 1] + b[i] * y[i] + c[i] * y[i + 1] = f[i], 0 < i < m,
+ * where y[0] and y[m] are known and m is power of 2.
+ * Equations are spoiled.
+ * @param a lower diagonal
+ * @param b main diagonal
+ * @param c upper diagonal
+ * @param f free members
+ * @param y solution
+ * @param m amount of equations plus one
  */
-void copyEdges(double* old, double* new, size_t N, size_t rows)
+void reduction(double* a, double* b, double* c, double* f, double* y, size_t m)
 {
-    /* Side edges */
-    double* dest = new;
-    const ptrdiff_t diff = old - new;
-    size_t y;
+    size_t step, i;
 
-    for (y = 0; y < rows; ++y)
+    /* Every equation is combined with two neighbours, unknowns are halved */
+    for (step = 2; step < m; step <<= 1)
     {
-        /* Left edge */
-        *dest = *(dest + diff);
-        dest += N - 1;
-
-        /* Right edge */
-        *dest = *(dest + diff);
-        ++dest;
+        const size_t s = step >> 1;
+        for (i = step; i < m; i += step)
+        {
+            const double p = a[i] / b[i - s];
+            const double q = c[i] / b[i + s];
+            f[i] -= p * f[i - s] + q * f[i + s];
+            b[i] -= p * c[i - s] + q * a[i + s];
+            a[i] = -p * a[i - s];
+            c[i] = -q * c[i + s];
+        }
     }
 
-    /* Top edge */
-    memcpy(new, new + diff, N * sizeof(double));
-    
-    /* Bottom edge */
-    new += (rows - 1) * N,
-    memcpy(new, new + diff, N * sizeof(double));
+    /* Unknowns are restored in reverse order */
+    for (step = m >> 1; step > 0; step >>= 1)
+        for (i = step; i < m; i += step << 1)
+            y[i] = (f[i] - a[i] * y[i - step] - c[i] * y[i + step]) / b[i];
 }
 
- /* Thread-look exchage scheme:
-  *     ODD          EVEN
-  *   <-|0|          |0|-<         
-  *   >-|1|          |1|->
-  *     |2|->      >-|2|
-  *     |3|-<      <-|3|
-  */
-
-/* Vectors exchange scheme
- *
- * |            |
- * |____________| <->  ************
- *  ************  <-> |            |
- *                    |            |
- */
 /**
- * Exchange 
- * @param f exchanging field
- * @param N size of row
- * @param rows amount of rows
- * @param rank mpi rank
- * @param size mpi size
+ * Solves implicit half of ADI step in whole lines,
+ * edges of the whole grid are not changed
+ * @param rho tau / (2 * h * h)
+ * @param l lines with right parts, they are replaced by solution
+ * @param N grid size
+ * @param first number of the first line in the whole grid
  */
-void exchange(double* f, size_t N, size_t rows, int rank, int isBottom) {
-    if (rank % 2)
+void solveLines(double rho, const Lines* l, size_t N, size_t first)
+{
+    /* System is padded to power of 2 by trivial equations y[i] = 0 */
+    size_t m = 2;
+    while (m < N - 1)
+        m <<= 1;
+
+#ifdef _OPENMP
+#pragma omp parallel if (l->amount * N >= PARALLEL_MIN)
+#endif
     {
-        MPI_Send(f + N, N, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD);
-        MPI_Recv(f    , N, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        if (!isBottom)
+        double* const a = (double*)malloc(5 * (m + 1) * sizeof(double));
+        double* const b = a + (m + 1);
+        double* const c = b + (m + 1);
+        double* const f = c + (m + 1);
+        double* const u = f + (m + 1);
+        long j;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (j = 0; j < (long)l->amount; ++j)
         {
-            f += (rows - 2) * N;
-            MPI_Send(f    , N, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD);
-            MPI_Recv(f + N, N, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            Real* const y = l->lines + j * N;
+            size_t i;
+
+            if (first + j == 0 || first + j == N - 1)
+                continue;
+
+            for (i = 1; i < N - 1; ++i)
+            {
+                a[i] = c[i] = -rho;
+                b[i] = 1. + 2. * rho;
+                f[i] = y[i];
+            }
+            for (; i < m; ++i)
+            {
+                a[i] = c[i] = 0.;
+                b[i] = 1.;
+                f[i] = i == N - 1 ? y[i] : 0.;
+            }
+            u[0] = y[0];
+            u[m] = m == N - 1 ? y[m] : 0.;
+
+            reduction(a, b, c, f, u, m);
+            for (i = 1; i < N - 1; ++i)
+                y[i] = u[i];
         }
+        free(a);
     }
-    else {
-        if (!isBottom)
-        {
-            f += (rows - 2) * N;
-            MPI_Recv(f + N, N, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            MPI_Send(f    , N, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD);            
-            f -= (rows - 2) * N;
-        }
-        if (rank != 0)
+}
+
+/**
+ * Counts explicit half of ADI step in one direction
+ * @param rho tau / (2 * h * h)
+ * @param from field
+ * @param to right part of implicit half
+ * @param c chunk
+ * @param dist distance to neighbours in memory, ld for columns and 1 for rows
+ */
+void explicitHalf(double rho, const Real* from, Real* to, const Chunk* c,
+                  size_t dist)
+{
+    const long y0 = c->ylo;
+    const long y1 = c->yhi;
+    long y;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if ((y1 - y0) * (c->xhi - c->xlo) >= PARALLEL_MIN)
+#endif
+    for (y = y0; y < y1; ++y)
+    {
+        size_t x;
+        for (x = c->xlo; x < c->xhi; ++x)
         {
-            MPI_Recv(f    , N, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            MPI_Send(f + N, N, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD);
+            const size_t p = y * c->ld + x;
+            to[p] = rho * ((double)from[p - dist] + from[p + dist]) + (1. - 2. * rho) * from[p];
         }
     }
 }
- 
+
 /**
- * Counts values in new layer from old layer
- * @param th2 tau div sqr h
+ * Makes implicit ADI steps, result is in old layer
+ * @param rho tau / (2 * h * h)
  * @param old old layer
- * @param new new layer
- * @param N size of row
- * @param rows amount of rows
-*/
-void count(double th2, double* old, double* new, size_t N, size_t rows)
+ * @param new new layer for intermediate results, with the same edges
+ * @param c chunk
+ * @param steps amount of steps
+ * @return time spent in exchange and transposition
+ */
+double countADI(double rho, Real* old, Real* new, const Chunk* c, unsigned steps)
 {
-    /* ________________|_##############_|_##############_|________________ */
-    size_t x, y;
-    const size_t rowsT = rows - 2;
-    const size_t columnsT = N - 2;    
-    const ptrdiff_t diff = new - old; /* optimized memcpy style */
-    old += N + 1;                     /* first point */
+    Lines rows, cols;
+    double time = 0.;
 
-    for (y = 0; y < rowsT; ++y, old += 2)    /* skip edges */
-        for (x = 0; x < columnsT; ++x, ++old)
-            *(old + diff) = *old +
-            (- 4 * *old + *(old - 1) + *(old + 1) + *(old - N) + *(old + N)) * th2;
+    createLines(&rows, c, 1);
+    createLines(&cols, c, 0);
+
+    for (; steps > 0; --steps)
+    {
+        /* Implicit by rows */
+        time -= MPI_Wtime();
+        exchange(old, c);
+        time += MPI_Wtime();
+        explicitHalf(rho, old, new, c, c->ld);
+        time += transpose(new, &rows, 0);
+        solveLines(rho, &rows, c->N, c->y0 + rows.first);
+        time += transpose(new, &rows, 1);
+
+        /* Implicit by columns */
+        time -= MPI_Wtime();
+        exchange(new, c);
+        time += MPI_Wtime();
+        explicitHalf(rho, new, old, c, 1);
+        time += transpose(old, &cols, 0);
+        solveLines(rho, &cols, c->N, c->x0 + cols.first);
+        time += transpose(old, &cols, 1);
+    }
+
+    freeLines(&rows);
+    freeLines(&cols);
+    return time;
 }
 
 /**
  * Heat equation solver
- * @param a alpha parameter of basis function
- * @param b beta parameter of basis function
- * @param T time to count to
+ * @param cases parameters of runs, all of them are counted together
+ * @param amount amount of cases
  * @param N grid density
  * @param rank mpi rank
  * @param size mpi size
+ * @param opts run options
  */
-void heat(double a, double b, double T, unsigned N, int rank, int size)
+void heat(const Case* cases, unsigned amount, unsigned N, int rank, int size,
+          const Options* opts)
 {
     /* Coordinate and time steps */
     const double h   = 1. / (N - 1);
-    const double t   = h * h / 4.;
+    const double t   = opts->order4 ? h * h / 6. : h * h / 4.;
     const double th2 = t / (h * h);
     
-    /* amount of steps to run */
-    const unsigned needSteps = (ceil(T / t) + 1) / 2;
+    /* Single steps of every case and their tau div sqr h */
+    unsigned* totals = (unsigned*)malloc(amount * sizeof(unsigned));
+    double* th2s = (double*)malloc(amount * sizeof(double));
     
     /* Counting */
     unsigned steps = 0;
+    unsigned rest = 0;  /* single steps of the longest case */
+    unsigned total;
+    unsigned e;
 
-    /* io is used only on 0 thread to split data to all threads and  */
-    /* gather it after calculations */
-    double* io = NULL;
-    
-    /* We will work in two areas, 'old' and 'new' */
-    double* old;
-    double* new;
-    
-    /* Scatter sizes */
-    int* const sendcl = (int*)malloc(sizeof(int) * size);
-    int* const destcl = (int*)malloc(sizeof(int) * size);
-    size_t rows;
+    Header header = {{'H', 'E', 'A', 'T'}, 0, sizeof(Real), 0, 0, 0, 0., 0., 0.};
+
+    /* Checkpoints statistics */
+    unsigned checkpoints = 0;
+    double checkpointTime = 0.;
+
+    /* Exchange statistics */
+    unsigned exchanges = 0;
+    double exchangeTime = 0.;
+
+    /* Counting time since the last check of balance */
+    double busy = 0.;
+    unsigned balanced = 0;
+
+    /* Persistent requests of both layers, swapped together with layers */
+    MPI_Request persistent[2][8];
+    MPI_Request* oldReqs = NULL;
+    MPI_Request* newReqs = NULL;
+
+    /* Counting threads, all but I/O one */
+    MPI_Comm counters = MPI_COMM_WORLD;
+    Snapshots snapshots;
+    Shared shared;
+    Rma rma;
+
+    /* We will work in two areas, 'old' and 'new', cases follow each other */
+    Real* old;
+    Real* new;
     
-    /* Fill data with initial values */
-    if (!rank) {
-        io = (double*)malloc(sizeof(double) * N * N);
-        fill(io, a, b, N);
+    Chunk c;
+    size_t area;
+    const char* kernelName = chooseKernel(opts->kernel, opts->nt);
+
+    if (!kernelName)
+        ERRORPRINT("Kernel is not supported!\n");
+    if (opts->order4)
+    {
+        kernel = countCompact;
+        kernelName = "compact";
     }
+    if (!rank)
+        fprintf(stdout, "Kernel is %s%s\n", kernelName, opts->nt ? " with non-temporal stores" : "");
+#ifdef _OPENMP
+    if (opts->threads)
+        omp_set_num_threads(opts->threads);
+    if (!rank)
+        fprintf(stdout, "OpenMP threads: %d\n", omp_get_max_threads());
+#endif
+
+    header.order = opts->order4 ? 4 : 2;
+    if (opts->snapshot)
+    {
+        if (size < 2)
+            ERRORPRINT("Snapshots need one more thread for output!\n");
+
+        /* The last thread only writes snapshots */
+        MPI_Comm_split(MPI_COMM_WORLD, rank == size - 1, rank, &counters);
+        if (rank == size - 1)
+        {
+            header.N = (N - 1) / opts->decimate + 1;
+            header.T = cases[0].T;
+            header.a = cases[0].a;
+            header.b = cases[0].b;
+            writeSnapshots(size - 1, &header);
+            MPI_Comm_free(&counters);
+            free(th2s);
+            free(totals);
+            return;
+        }
+    }
+
+    switch (createChunk(&c, N, opts->strips, opts->halo, counters, NULL))
+    {
+    case -1: ERRORPRINT("Communicator size is too large for the grid!\n");
+    case -2: ERRORPRINT("Halo is wider than chunks!\n");
+    }
+
+    if (opts->balance)
+    {
+        size_t* bounds = weighRows(&c, calibrate(th2, cases[0].a, cases[0].b, &c, opts->balance));
+        resplit(&c, bounds);
+        free(bounds);
+        reportRows(&c);
+    }
+
+    for (e = 0; e < amount; ++e)
+    {
+        /* amount of steps to run, it is even */
+        const unsigned needSteps = (ceil(cases[e].T / t) + 1) / 2;
+        totals[e] = 2 * needSteps;
+
+        /* Compact scheme ends exactly at T, tau is reduced by O(h^4),
+           so it keeps the fourth order */
+        th2s[e] = opts->order4 && needSteps ? cases[e].T / totals[e] / (h * h) : th2;
+        if (totals[e] > rest)
+            rest = totals[e];
+    }
+    total = totals[0];
+
+    /* Chunk with halo */
+    area = (c.rows + 2 * c.H) * c.ld;
+    if (opts->shared)
+    {
+        old = createShared(&shared, &c, area);
+        reportShared(&shared, &c);
+    }
+    else
+        old = allocField(amount * area);
+    for (e = 0; e < amount; ++e)
+        touchField(old + e * area, &c);
+    if (amount > 1)
+        stackCases(&c, amount, area);
     
-    scatter(N, sendcl, destcl, size);
-    
-    rows = (sendcl[rank] / N) + 2 /* Our data and neighbour threads' data */
-        - (!rank || rank == (size - 1))  /* No neighbour for edge threas */
-        - (size == 1);                   /* No neighbours for one thread */
-    
-    old = (double*)malloc(sizeof(double) * N * rows);
-    
-    /* Scattering */
-    MPI_Scatterv(io, sendcl, destcl, MPI_DOUBLE, old + (!!rank) * N, sendcl[rank], MPI_DOUBLE,
-                0, MPI_COMM_WORLD);
+    if (opts->restart)
+    {
+        if (readGrid(CHECKPOINT, old, &c, &header))
+            ERRORPRINT("There is no checkpoint for this grid!\n");
+        if (header.T != cases[0].T || header.a != cases[0].a || header.b != cases[0].b
+            || header.order != (opts->order4 ? 4u : 2u))
+            ERRORPRINT("Checkpoint is made with another T, a, b or scheme!\n");
+        steps = header.steps;
+        rest = steps < rest ? rest - steps : 0;
+        if (!rank)
+            fprintf(stdout, "Restart from step %u\n", steps);
+    }
+    else
+        /* Every thread fills its chunk with initial values */
+        for (e = 0; e < amount; ++e)
+            fill(old + e * area, cases[e].a, cases[e].b, &c);
+
+    header.N = N;
+    header.T = cases[0].T;
+    header.a = cases[0].a;
+    header.b = cases[0].b;
+
+    /* Doubling field, edges of the whole grid in halo are copied too */
+    new = opts->shared ? old + area : allocField(amount * area);
+    for (e = 0; e < amount; ++e)
+        touchField(new + e * area, &c);
+    exchange(old, &c);
+    for (e = 0; e < amount; ++e)
+        copyEdges(old + e * area, new + e * area, &c);
+
+    if (opts->rma)
+        createRma(&rma, &c, old, new, amount, !strcmp(opts->rma, "fence"));
+
+    if (opts->snapshot)
+        startSnapshots(&snapshots, &c, opts->decimate, size - 1);
+
+    if (opts->persistent)
+    {
+        oldReqs = persistent[0];
+        newReqs = persistent[1];
+        exchangeRequests(old, &c, !opts->overlap, 1, oldReqs);
+        exchangeRequests(new, &c, !opts->overlap, 1, newReqs);
+    }
 
-    /* Doubling field */
-    new = (double*)malloc(sizeof(double) * N * rows);
-    copyEdges(old, new, N, rows);
+    /* Implicit steps are made at once, explicit loop is skipped,
+       tau is reduced so that the last step ends at T */
+    if (opts->adi > 0.)
+    {
+        total = ceil(cases[0].T / opts->adi);
+        exchangeTime = countADI(total ? cases[0].T / total / (2. * h * h) : 0.,
+                                old, new, &c, total);
+        steps = total;
+        exchanges = 2 * total;
+        rest = 0;
+    }
 
-    while (steps++ < needSteps)
+    /* One exchange per H steps */
+    while (rest > 0)
     {
-        exchange(old, N, rows, rank, rank == size - 1);
-        count(th2, old, new, N, rows);
-        exchange(new, N, rows, rank, rank == size - 1);
-        count(th2, new, old, N, rows);
+        const size_t n = rest < c.H ? rest : c.H;
+        const double exchanged = exchangeTime;
+        size_t j;
+
+        busy -= MPI_Wtime();
+        if (opts->overlap)
+            exchangeTime += countOverlapped(th2s[0], old, new, &c, oldReqs);
+        else
+        {
+            exchangeTime -= MPI_Wtime();
+            if (opts->persistent)
+                exchangePersistent(oldReqs);
+            else if (opts->shared)
+                exchangeShared(old, &c, &shared);
+            else if (opts->rma)
+                exchangeRma(old, &c, &rma);
+            else
+                exchange(old, &c);
+            exchangeTime += MPI_Wtime();
+
+            /* Finished cases are not counted, but they are still exchanged */
+            for (e = 0; e < amount; ++e)
+            {
+                Real* const o = old + e * area;
+                Real* const w = new + e * area;
+                const size_t m = totals[e] < steps + n ? totals[e] - steps : n;
+
+                if (totals[e] <= steps)
+                    continue;
+
+                if (opts->tile)
+                    countTiled(th2s[e], o, w, &c, m, opts->tile);
+                else
+                    for (j = 0; j < m; ++j)
+                        countWide(th2s[e], j % 2 ? w : o, j % 2 ? o : w, &c, c.H - 1 - j);
+
+                /* Result of case finished in the middle must be in old layer after swap */
+                if (m % 2 != n % 2)
+                    memcpy(m % 2 ? o : w, m % 2 ? w : o, area * sizeof(Real));
+            }
+        }
+
+        /* Result is in new layer after odd amount of steps */
+        if (n % 2)
+        {
+            Real* swap = old;
+            MPI_Request* swapReqs = oldReqs;
+            old = new;
+            new = swap;
+            oldReqs = newReqs;
+            newReqs = swapReqs;
+        }
+        busy += MPI_Wtime() - (exchangeTime - exchanged);
+        rest -= n;
+        steps += n;
+        ++exchanges;
+
+        if (opts->checkpoint && rest > 0 && steps % opts->checkpoint < n)
+        {
+            header.steps = steps;
+            checkpointTime += checkpoint(old, &c, &header);
+            ++checkpoints;
+        }
+
+        if (opts->stats && steps % opts->stats < n)
+            statistics(old, &c, steps);
+
+        if (opts->snapshot && steps % opts->snapshot < n)
+            sendSnapshot(&snapshots, old, &c, steps);
+
+        /* New layer keeps the previous step */
+        if (opts->eps > 0. && rest > 0 && steps % opts->check < n
+            && change(new, old, &c) < opts->eps)
+        {
+            if (!rank)
+                fprintf(stdout, "Steady state is reached\n");
+            break;
+        }
+
+        /* Rows are moved before the next exchange, which fills halo of new chunks */
+        if (opts->rebalance > 0. && rest > 0 && steps % opts->check < n)
+        {
+            if (rebalance(&c, &old, busy, steps - balanced, opts->rebalance))
+            {
+                area = (c.rows + 2 * c.H) * c.ld;
+                freeField(new);
+                new = allocField(area);
+                touchField(new, &c);
+                exchange(old, &c);
+                copyEdges(old, new, &c);
+                if (!rank)
+                    fprintf(stdout, "Rows are moved at step %u\n", steps);
+                reportRows(&c);
+            }
+            busy = 0.;
+            balanced = steps;
+        }
     }
+
+    if (!rank && !opts->ensemble)
+        fprintf(stdout, "Steps: %u of %u\n", steps, total);
+
+    if (opts->snapshot)
+        stopSnapshots(&snapshots, &c);
     
-    /* Gathering */
-    MPI_Gatherv(old + (!!rank) * N, sendcl[rank], MPI_DOUBLE, io, sendcl, destcl, MPI_DOUBLE,
-                0, MPI_COMM_WORLD);
+    if (opts->persistent)
+    {
+        int i;
+        for (i = 0; i < 8; ++i)
+        {
+            MPI_Request_free(persistent[0] + i);
+            MPI_Request_free(persistent[1] + i);
+        }
+    }
+
+    /* The slowest thread defines exchange time */
+    MPI_Reduce(rank ? &exchangeTime : MPI_IN_PLACE, &exchangeTime, 1, MPI_DOUBLE,
+               MPI_MAX, 0, c.comm);
+    if (!rank && exchanges)
+        fprintf(stdout, "Exchanges: %u, time is %.6f, %.9f per exchange\n",
+                exchanges, exchangeTime, exchangeTime / exchanges);
+
+    if (!rank && checkpoints)
+        fprintf(stdout, "Checkpoints: %u, time is %.6f, %.6f per checkpoint\n",
+                checkpoints, checkpointTime, checkpointTime / checkpoints);
+
+    /* Parallel output, every case of ensemble is written to its own file */
+    if (!opts->ensemble)
+    {
+        header.steps = steps;
+        writeGrid(FILENAME, old, &c, &header);
+    }
+    else
+        for (e = 0; e < amount; ++e)
+        {
+            char filename[64];
+            sprintf(filename, ENSEMBLE_FILENAME, e);
+            header.steps = totals[e];
+            header.T = cases[e].T;
+            header.a = cases[e].a;
+            header.b = cases[e].b;
+            writeGrid(filename, old + e * area, &c, &header);
+        }
     
-    /* Print gathered data */
+    freeChunk(&c);
+    if (counters != MPI_COMM_WORLD)
+        MPI_Comm_free(&counters);
+    if (opts->rma)
+        freeRma(&rma);
+    if (opts->shared)
+        freeShared(&shared);
+    else
+    {
+        freeField(new);
+        freeField(old);
+    }
+    free(th2s);
+    free(totals);
+}
+
+/**
+ * Reads cases of ensemble by 0 thread and broadcasts them
+ * @param filename file with lines "T a b"
+ * @param cases read cases, should be freed
+ * @return amount of cases, 0 if file is absent or empty
+ */
+unsigned readCases(const char* filename, Case** cases)
+{
+    unsigned amount = 0;
+    int rank;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    *cases = NULL;
     if (!rank)
-        print(io, N, N);
-    
-    free(io);
-    free(sendcl);
-    free(destcl);
-    free(new);
-    free(old);
+    {
+        FILE* fp = fopen(filename, "r");
+        unsigned capacity = 0;
+        Case one;
+
+        while (fp && fscanf(fp, "%lf %lf %lf", &one.T, &one.a, &one.b) == 3)
+        {
+            if (amount == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 16;
+                *cases = (Case*)realloc(*cases, capacity * sizeof(Case));
+            }
+            (*cases)[amount++] = one;
+        }
+        if (fp)
+            fclose(fp);
+    }
+
+    MPI_Bcast(&amount, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+    if (rank && amount)
+        *cases = (Case*)malloc(amount * sizeof(Case));
+    MPI_Bcast(*cases, 3 * amount, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    return amount;
+}
+
+/**
+ * Parses optional arguments
+ * @param argc argument counter
+ * @param argv argument list, options start from 5th one
+ * @param opts parsed options
+ * @return 0 on success, -1 on unknown or inconsistent options
+ */
+int parseOptions(int argc, char** argv, Options* opts)
+{
+    int i;
+    opts->overlap = 0;
+    opts->strips = 0;
+    opts->halo = 1;
+    opts->kernel = NULL;
+    opts->nt = 0;
+    opts->tile = 0;
+    opts->threads = 0;
+    opts->checkpoint = 0;
+    opts->restart = 0;
+    opts->persistent = 0;
+    opts->eps = 0.;
+    opts->check = 100;
+    opts->adi = 0.;
+    opts->ensemble = NULL;
+    opts->order4 = 0;
+    opts->stats = 0;
+    opts->snapshot = 0;
+    opts->decimate = 1;
+    opts->balance = 0;
+    opts->rebalance = 0.;
+    opts->shared = 0;
+    opts->rma = NULL;
+
+    for (i = 5; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-overlap"))
+            opts->overlap = 1;
+        else if (!strcmp(argv[i], "-strips"))
+            opts->strips = 1;
+        else if (!strcmp(argv[i], "-halo") && i + 1 < argc)
+            opts->halo = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-kernel") && i + 1 < argc)
+            opts->kernel = argv[++i];
+        else if (!strcmp(argv[i], "-nt"))
+            opts->nt = 1;
+        else if (!strcmp(argv[i], "-tile") && i + 1 < argc)
+            opts->tile = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            opts->threads = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-checkpoint") && i + 1 < argc)
+            opts->checkpoint = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-restart"))
+            opts->restart = 1;
+        else if (!strcmp(argv[i], "-persistent"))
+            opts->persistent = 1;
+        else if (!strcmp(argv[i], "-eps") && i + 1 < argc)
+            opts->eps = strtod(argv[++i], NULL);
+        else if (!strcmp(argv[i], "-check") && i + 1 < argc)
+            opts->check = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-adi") && i + 1 < argc)
+            opts->adi = strtod(argv[++i], NULL);
+        else if (!strcmp(argv[i], "-ensemble") && i + 1 < argc)
+            opts->ensemble = argv[++i];
+        else if (!strcmp(argv[i], "-order4"))
+            opts->order4 = 1;
+        else if (!strcmp(argv[i], "-stats") && i + 1 < argc)
+            opts->stats = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-snapshot") && i + 2 < argc)
+        {
+            opts->snapshot = strtoul(argv[++i], NULL, 0);
+            opts->decimate = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "-balance") && i + 1 < argc)
+            opts->balance = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-rebalance") && i + 1 < argc)
+            opts->rebalance = strtod(argv[++i], NULL);
+        else if (!strcmp(argv[i], "-shared"))
+            opts->shared = 1;
+        else if (!strcmp(argv[i], "-rma") && i + 1 < argc)
+            opts->rma = argv[++i];
+        else
+            return -1;
+    }
+
+    /* Overlapped exchange does not deliver corners of halo */
+    if (opts->halo == 0 || opts->check == 0 || (opts->halo > 1 && opts->overlap) || (opts->tile && opts->overlap))
+        return -1;
+
+    /* Implicit integrator has its own exchange and no intermediate layers */
+    if (opts->adi < 0. || (opts->adi > 0. && (opts->overlap || opts->halo > 1 || opts->tile
+        || opts->persistent || opts->checkpoint || opts->restart || opts->eps > 0.)))
+        return -1;
+
+    /* Cases are counted one by one between common exchanges */
+    if (opts->ensemble && (opts->overlap || opts->adi > 0. || opts->checkpoint
+        || opts->restart || opts->eps > 0.))
+        return -1;
+
+    /* Compact scheme has one scalar kernel and needs corners of halo */
+    if (opts->order4 && (opts->overlap || opts->adi > 0. || opts->kernel || opts->nt))
+        return -1;
+
+    /* Analysis follows the only case of explicit loop */
+    if ((opts->stats || opts->snapshot) && (opts->ensemble || opts->adi > 0.))
+        return -1;
+    if (opts->decimate == 0)
+        return -1;
+
+    /* Rows are moved in the only field of explicit loop, snapshot boxes are fixed */
+    if (opts->rebalance < 0. || (opts->rebalance > 0. && (opts->ensemble || opts->adi > 0.
+        || opts->persistent || opts->snapshot)))
+        return -1;
+
+    /* Shared exchange is blocking and has two fields of one case in window */
+    if (opts->shared && (opts->overlap || opts->persistent || opts->adi > 0.
+        || opts->ensemble || opts->rebalance > 0.))
+        return -1;
+
+    /* Windows are created once for both fields of blocking exchange */
+    if (opts->rma && ((strcmp(opts->rma, "fence") && strcmp(opts->rma, "pscw"))
+        || opts->overlap || opts->persistent || opts->shared || opts->adi > 0.
+        || opts->rebalance > 0.))
+        return -1;
+    return 0;
 }
 
 /**
  * Entry point
- * @param argc argument counter, should be equal 5
- * @param argv argument list (T, N, a, b)
+ * @param argc argument counter, should be equal 5 or more
+ * @param argv argument list (T, N, a, b, options)
  */
 int main(int argc, char** argv)
 {
+#ifdef _OPENMP
+    /* MPI is called only out of parallel regions, i.e. by master thread */
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#else
     MPI_Init(&argc, &argv);
+#endif
     {
         double T, a, b;
         unsigned N;
+        Options opts;
         double time = -MPI_Wtime();
 
         /* Communicator constants */        
@@ -336,19 +3002,44 @@ int main(int argc, char** argv)
         MPI_Comm_rank(MPI_COMM_WORLD, &rank);
         MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+#ifdef _OPENMP
+        if (provided < MPI_THREAD_FUNNELED)
+            ERRORPRINT("MPI does not support threads!\n");
+#endif
+
         /* Arguments parsing */
-        if (argc != 5)
-            ERRORPRINT("Syntax error!\nArguments are following: a, b, T, N\n");
+        if (argc < 5 || parseOptions(argc, argv, &opts))
+        {
+            const char* const* line = usage;
+            if (!rank)
+                for (fprintf(stderr, "Syntax error!\n"); *line; ++line)
+                    fprintf(stderr, "%s", *line);
+            MPI_Finalize();
+            return 1;
+        }
             
         T = strtod(argv[1], NULL);
         a = strtod(argv[3], NULL);
         b = strtod(argv[4], NULL);
         N = strtoul(argv[2], NULL, 0);
 
-        if (size > N)
-            ERRORPRINT("Communicator size is less than amount of grid rows!\n");
-    
-        heat(a, b, T, N, rank, size);
+        if (opts.ensemble)
+        {
+            Case* cases;
+            const unsigned amount = readCases(opts.ensemble, &cases);
+            if (!amount)
+                ERRORPRINT("There are no cases in ensemble file!\n");
+            heat(cases, amount, N, rank, size, &opts);
+            free(cases);
+        }
+        else
+        {
+            Case one;
+            one.T = T;
+            one.a = a;
+            one.b = b;
+            heat(&one, 1, N, rank, size, &opts);
+        }
 
         if (!rank)
             fprintf(stdout, "Time is %.15f\n", time += MPI_Wtime());
@@ -0,0 +1,554 @@
+/**
+ * heat3d.c
+ *
+ * Solving 3D heat equation with MPI
+ * Arguments and decomposition are the same as in heat.c, but grid is
+ * N * N * N cube split at boxes on 3D Cartesian grid of threads.
+ * Build with -fopenmp to count every box with several OpenMP threads.
+ * Result is written to binary file: header and N planes of N rows.
+ *
+ * @author pikryukov
+ * @version 1.0
+ *
+ * e-mail: kryukov@frtk.ru
+ *
+ * Copyright (C) Kryukov Pavel 2012
+ * for MIPT MPI course.
+ */
+
+#include <stdlib.h> /* strtod, strtoul, calloc, free */
+#include <string.h> /* memcpy, strcmp */
+#include <stdio.h>  /* fprintf */
+#include <math.h>   /* exp, ceil */
+
+#include <mpi.h>
+
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
+
+#define FILENAME "result3d_kryukov.bin"
+
+#define ERRORPRINT(x) {if (!rank) fprintf(stderr, x); MPI_Finalize(); exit(1);}
+
+/* Usage is split at lines, as ISO C90 does not allow long strings */
+static const char* const usage[] =
+{
+    "Arguments are following: T, N, a, b [options]\n",
+    "Options:\n",
+    "  -overlap        overlap halo exchange with interior counting\n",
+    "  -threads n      amount of OpenMP threads in every process\n",
+    NULL
+};
+
+/**
+ * Header of binary file with grid, grid planes follow it
+ * Numbers are stored in native byte order.
+ */
+typedef struct
+{
+    char magic[4];     /* "HE3D" */
+    unsigned N;        /* Grid size */
+    unsigned elemSize; /* Size of one point in bytes */
+    unsigned steps;    /* Amount of steps made */
+    double T, a, b;    /* Parameters of run */
+} Header;
+
+/**
+ * Optional run parameters
+ */
+typedef struct
+{
+    int overlap;        /* Non-blocking exchange hidden behind interior counting */
+    unsigned threads;   /* Amount of OpenMP threads, 0 for default */
+} Options;
+
+/*
+ * Dimensions are numbered as in C arrays: 0 is for planes (z),
+ * 1 is for rows (y), 2 is for columns (x).
+ * Every box is surrounded by halo of width 1, so own point (z, y, x) is
+ * f[(z + 1) * plane + (y + 1) * ld + x + 1], where ld = cols + 2 and
+ * plane = (rows + 2) * ld. 7-point scheme does not read edges and corners
+ * of halo, so only faces are exchanged:
+ *
+ *        ______
+ *       /  z  /|
+ *      /_____/ |
+ *      |     |x|  <- face from right thread
+ *      |  y  | /
+ *      |_____|/
+ */
+
+/**
+ * Box of grid owned by thread
+ */
+typedef struct
+{
+    MPI_Comm comm;       /* Cartesian communicator */
+    int dims[3];         /* Amount of threads by every dimension */
+    int coords[3];       /* Coordinates of thread in Cartesian grid */
+    int lo[3], hi[3];    /* Neighbours, MPI_PROC_NULL on grid faces */
+    size_t N;            /* Grid size */
+    size_t n[3];         /* Amount of own planes, rows and columns */
+    size_t o[3];         /* Position of the first own point in grid */
+    size_t ld;           /* Distance between rows in memory */
+    size_t plane;        /* Distance between planes in memory */
+    size_t stride[3];    /* Distance between neighbours by every dimension */
+    size_t first[3];     /* Counted points, [first, last), in memory coordinates */
+    size_t last[3];
+    MPI_Datatype face[3]; /* Own face orthogonal to every dimension */
+} Box;
+
+/**
+ * Scatters grid lines to threads with minimal recip, the same as in heat.c
+ * @param N amount of grid lines
+ * @param parts amount of threads lines are split to
+ * @param part number of thread
+ * @param offset first line of thread
+ * @return amount of lines of thread
+ */
+size_t scatter(size_t N, int parts, int part, size_t* offset)
+{
+    const size_t resRank = parts - N % parts;
+    const size_t amount = N / parts;
+
+    *offset = part * amount;
+    if (part < resRank)
+        return amount;
+
+    /* Split recip to the bottom threads */
+    *offset += part - resRank;
+    return amount + 1;
+}
+
+/**
+ * Splits grid to boxes between threads
+ * @param b created box
+ * @param N grid size
+ * @param size mpi size
+ * @return 0 on success, -1 if grid is too small for such amount of threads
+ */
+int createBox(Box* b, unsigned N, int size)
+{
+    const int periods[3] = {0, 0, 0};
+    MPI_Datatype column;
+    int rank, d;
+
+    b->dims[0] = b->dims[1] = b->dims[2] = 0;
+    MPI_Dims_create(size, 3, b->dims);
+    if (b->dims[0] > N || b->dims[1] > N || b->dims[2] > N)
+        return -1;
+
+    /* Keep ranks order, so 0 thread is still in the corner */
+    MPI_Cart_create(MPI_COMM_WORLD, 3, b->dims, periods, 0, &b->comm);
+    MPI_Comm_rank(b->comm, &rank);
+    MPI_Cart_coords(b->comm, rank, 3, b->coords);
+
+    b->N = N;
+    for (d = 0; d < 3; ++d)
+    {
+        MPI_Cart_shift(b->comm, d, 1, b->lo + d, b->hi + d);
+        b->n[d] = scatter(N, b->dims[d], b->coords[d], b->o + d);
+
+        /* Faces of the whole grid are not counted */
+        b->first[d] = 1 + (b->o[d] == 0);
+        b->last[d] = 1 + b->n[d] - (b->o[d] + b->n[d] == N);
+    }
+    b->ld = b->n[2] + 2;
+    b->plane = (b->n[1] + 2) * b->ld;
+    b->stride[0] = b->plane;
+    b->stride[1] = b->ld;
+    b->stride[2] = 1;
+
+    MPI_Type_vector(b->n[1], b->n[2], b->ld, MPI_DOUBLE, b->face);
+    MPI_Type_vector(b->n[0], b->n[2], b->plane, MPI_DOUBLE, b->face + 1);
+    MPI_Type_vector(b->n[1], 1, b->ld, MPI_DOUBLE, &column);
+    MPI_Type_create_hvector(b->n[0], 1, b->plane * sizeof(double), column, b->face + 2);
+    MPI_Type_free(&column);
+    for (d = 0; d < 3; ++d)
+        MPI_Type_commit(b->face + d);
+    return 0;
+}
+
+/**
+ * Frees box resources
+ * @param b box
+ */
+void freeBox(Box* b)
+{
+    int d;
+    for (d = 0; d < 3; ++d)
+        MPI_Type_free(b->face + d);
+    MPI_Comm_free(&b->comm);
+}
+
+/**
+ * Prints memory and halo volume of the biggest box, so jobs may be sized
+ * @param b box
+ */
+void report(const Box* b)
+{
+    /* Two fields with halo */
+    const double memory = 2. * (b->n[0] + 2) * b->plane * sizeof(double);
+    double maxMemory;
+    unsigned long halo = 0, maxHalo, totalHalo;
+    int rank, d;
+
+    for (d = 0; d < 3; ++d)
+    {
+        const unsigned long face = b->n[0] * b->n[1] * b->n[2] / b->n[d];
+        halo += face * ((b->lo[d] != MPI_PROC_NULL) + (b->hi[d] != MPI_PROC_NULL));
+    }
+
+    MPI_Comm_rank(b->comm, &rank);
+    MPI_Reduce((void*)&memory, &maxMemory, 1, MPI_DOUBLE, MPI_MAX, 0, b->comm);
+    MPI_Reduce(&halo, &maxHalo, 1, MPI_UNSIGNED_LONG, MPI_MAX, 0, b->comm);
+    MPI_Reduce(&halo, &totalHalo, 1, MPI_UNSIGNED_LONG, MPI_SUM, 0, b->comm);
+    if (!rank)
+    {
+        fprintf(stdout, "Grid %lu^3 on %d x %d x %d threads\n",
+                (unsigned long)b->N, b->dims[0], b->dims[1], b->dims[2]);
+        fprintf(stdout, "Memory per thread: %.3f MB\n", maxMemory / (1 << 20));
+        fprintf(stdout, "Halo per step: %lu points per thread, %lu in total (%.3f MB)\n",
+                maxHalo, totalHalo, (double)totalHalo * sizeof(double) / (1 << 20));
+    }
+}
+
+/**
+ * Fills box with initial values, plane z = 0 is the same as in heat.c
+ * @param f filling field
+ * @param a alpha parameter of input function
+ * @param beta beta parameter of input function
+ * @param b box
+ */
+void fill(double* f, double a, double beta, const Box* b)
+{
+    size_t x, y, z;
+    /* Exponent multiplier */
+    double multiplier = ((b->N - 1) * a);
+    multiplier *= multiplier;
+    multiplier = - 1. / multiplier;
+
+    for (z = b->o[0]; z < b->o[0] + b->n[0]; ++z)
+        for (y = b->o[1]; y < b->o[1] + b->n[1]; ++y)
+        {
+            double* p = f + (z - b->o[0] + 1) * b->plane + (y - b->o[1] + 1) * b->ld + 1;
+            for (x = b->o[2]; x < b->o[2] + b->n[2]; ++x)
+                *(p++) = exp(multiplier * (x * x - 2 * beta * x * y + y * y + z * z));
+        }
+}
+
+/**
+ * Starts exchange of faces with neighbour threads
+ * @param f exchanging field
+ * @param b box
+ * @param reqs array of 12 requests
+ */
+void startExchange(double* f, const Box* b, MPI_Request* reqs)
+{
+    double* const own = f + b->plane + b->ld + 1;
+    int d;
+
+    for (d = 0; d < 3; ++d)
+    {
+        const size_t s = b->stride[d];
+        double* const last = own + (b->n[d] - 1) * s;
+
+        MPI_Irecv(own - s, 1, b->face[d], b->lo[d], 0, b->comm, reqs + 4 * d);
+        MPI_Irecv(last + s, 1, b->face[d], b->hi[d], 0, b->comm, reqs + 4 * d + 1);
+        MPI_Isend(own, 1, b->face[d], b->lo[d], 0, b->comm, reqs + 4 * d + 2);
+        MPI_Isend(last, 1, b->face[d], b->hi[d], 0, b->comm, reqs + 4 * d + 3);
+    }
+}
+
+/**
+ * Counts values in new layer from old layer in box [lo, hi)
+ * @param th2 tau div sqr h
+ * @param old old layer
+ * @param new new layer
+ * @param b box
+ * @param lo first counted point in memory coordinates
+ * @param hi point after the last counted one
+ */
+void countBox(double th2, const double* old, double* new, const Box* b,
+              const size_t* lo, const size_t* hi)
+{
+    const size_t ld = b->ld;
+    const size_t plane = b->plane;
+    long z;
+
+    if (lo[0] >= hi[0] || lo[1] >= hi[1] || lo[2] >= hi[2])
+        return;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (z = lo[0]; z < (long)hi[0]; ++z)
+    {
+        size_t x, y;
+        for (y = lo[1]; y < hi[1]; ++y)
+        {
+            const double* o = old + z * plane + y * ld;
+            double* n = new + z * plane + y * ld;
+            for (x = lo[2]; x < hi[2]; ++x)
+                n[x] = o[x] + (- 6. * o[x] + o[x - 1] + o[x + 1] + o[x - ld] + o[x + ld]
+                               + o[x - plane] + o[x + plane]) * th2;
+        }
+    }
+}
+
+/**
+ * Makes one step: exchanges faces of old layer and counts new layer
+ * @param th2 tau div sqr h
+ * @param old old layer
+ * @param new new layer
+ * @param b box
+ * @param overlap 1 to count inner points while faces are travelling
+ * @return time spent in exchange
+ */
+double step(double th2, double* old, double* new, const Box* b, int overlap)
+{
+    MPI_Request reqs[12];
+    size_t lo[3], hi[3];
+    double time = -MPI_Wtime();
+    int d;
+
+    startExchange(old, b, reqs);
+    if (!overlap)
+    {
+        MPI_Waitall(12, reqs, MPI_STATUSES_IGNORE);
+        time += MPI_Wtime();
+        countBox(th2, old, new, b, b->first, b->last);
+        return time;
+    }
+    time += MPI_Wtime();
+
+    /* Inner box does not touch received faces */
+    for (d = 0; d < 3; ++d)
+    {
+        lo[d] = b->first[d] + (b->lo[d] != MPI_PROC_NULL);
+        hi[d] = b->last[d] - (b->hi[d] != MPI_PROC_NULL);
+        if (lo[d] > hi[d])
+            lo[d] = hi[d];
+    }
+    countBox(th2, old, new, b, lo, hi);
+
+    time -= MPI_Wtime();
+    MPI_Waitall(12, reqs, MPI_STATUSES_IGNORE);
+    time += MPI_Wtime();
+
+    /* Six slabs around inner box, every next one is narrowed by the previous */
+    for (d = 0; d < 3; ++d)
+    {
+        size_t slabLo[3], slabHi[3];
+        int k;
+        for (k = 0; k < 3; ++k)
+        {
+            slabLo[k] = k < d ? lo[k] : b->first[k];
+            slabHi[k] = k < d ? hi[k] : b->last[k];
+        }
+        slabHi[d] = lo[d];
+        countBox(th2, old, new, b, slabLo, slabHi);
+        slabLo[d] = hi[d];
+        slabHi[d] = b->last[d];
+        countBox(th2, old, new, b, slabLo, slabHi);
+    }
+    return time;
+}
+
+/**
+ * Writes boxes of all threads to binary file with collective MPI-IO
+ * @param filename file name
+ * @param f box with halo
+ * @param b box
+ * @param header file header, it is written by 0 thread
+ */
+void writeGrid(const char* filename, double* f, const Box* b, const Header* header)
+{
+    int rank, d;
+    int sizes[3], subsizes[3], starts[3];
+    MPI_File fh;
+    MPI_Datatype grid, own;
+
+    for (d = 0; d < 3; ++d)
+    {
+        sizes[d] = b->N;
+        subsizes[d] = b->n[d];
+        starts[d] = b->o[d];
+    }
+    MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &grid);
+    MPI_Type_commit(&grid);
+    sizes[0] = b->n[0] + 2;
+    sizes[1] = b->n[1] + 2;
+    sizes[2] = b->ld;
+    starts[0] = starts[1] = starts[2] = 1;
+    MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &own);
+    MPI_Type_commit(&own);
+
+    MPI_Comm_rank(b->comm, &rank);
+    MPI_File_open(b->comm, (char*)filename, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                  MPI_INFO_NULL, &fh);
+    MPI_File_set_size(fh, 0);
+    if (!rank)
+        MPI_File_write_at(fh, 0, (void*)header, sizeof(Header), MPI_BYTE, MPI_STATUS_IGNORE);
+
+    /* Every thread sees only its box of grid */
+    MPI_File_set_view(fh, sizeof(Header), MPI_DOUBLE, grid, "native", MPI_INFO_NULL);
+    MPI_File_write_at_all(fh, 0, f, 1, own, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+
+    MPI_Type_free(&grid);
+    MPI_Type_free(&own);
+}
+
+/**
+ * Heat equation solver
+ * @param a alpha parameter of basis function
+ * @param beta beta parameter of basis function
+ * @param T time to count to
+ * @param N grid density
+ * @param rank mpi rank
+ * @param size mpi size
+ * @param opts run options
+ */
+void heat(double a, double beta, double T, unsigned N, int rank, int size,
+          const Options* opts)
+{
+    /* Coordinate and time steps, 7-point scheme is stable till h * h / 6 */
+    const double h   = 1. / (N - 1);
+    const double t   = h * h / 6.;
+    const double th2 = t / (h * h);
+    const unsigned steps = ceil(T / t);
+
+    Header header = {{'H', 'E', '3', 'D'}, 0, sizeof(double), 0, 0., 0., 0.};
+    double exchangeTime = 0.;
+    double* old;
+    double* new;
+    size_t area;
+    unsigned i;
+    Box b;
+
+#ifdef _OPENMP
+    if (opts->threads)
+        omp_set_num_threads(opts->threads);
+    if (!rank)
+        fprintf(stdout, "OpenMP threads: %d\n", omp_get_max_threads());
+#endif
+
+    if (createBox(&b, N, size))
+        ERRORPRINT("Communicator size is too large for the grid!\n");
+    report(&b);
+
+    /* Faces of the whole grid are not changed, so new layer is copy of old one */
+    area = (b.n[0] + 2) * b.plane;
+    old = (double*)calloc(area, sizeof(double));
+    new = (double*)calloc(area, sizeof(double));
+    fill(old, a, beta, &b);
+    memcpy(new, old, area * sizeof(double));
+
+    for (i = 0; i < steps; ++i)
+    {
+        double* swap = old;
+        exchangeTime += step(th2, old, new, &b, opts->overlap);
+        old = new;
+        new = swap;
+    }
+
+    /* The slowest thread defines exchange time */
+    MPI_Reduce(rank ? &exchangeTime : MPI_IN_PLACE, &exchangeTime, 1, MPI_DOUBLE,
+               MPI_MAX, 0, b.comm);
+    if (!rank)
+        fprintf(stdout, "Steps: %u, exchange time is %.6f\n", steps, exchangeTime);
+
+    /* Parallel output */
+    header.N = N;
+    header.steps = steps;
+    header.T = T;
+    header.a = a;
+    header.b = beta;
+    writeGrid(FILENAME, old, &b, &header);
+
+    freeBox(&b);
+    free(new);
+    free(old);
+}
+
+/**
+ * Parses optional arguments
+ * @param argc argument counter
+ * @param argv argument list, options start from 5th one
+ * @param opts parsed options
+ * @return 0 on success, -1 on unknown options
+ */
+int parseOptions(int argc, char** argv, Options* opts)
+{
+    int i;
+    opts->overlap = 0;
+    opts->threads = 0;
+
+    for (i = 5; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-overlap"))
+            opts->overlap = 1;
+        else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            opts->threads = strtoul(argv[++i], NULL, 0);
+        else
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Entry point
+ * @param argc argument counter, should be equal 5 or more
+ * @param argv argument list (T, N, a, b, options)
+ */
+int main(int argc, char** argv)
+{
+#ifdef _OPENMP
+    /* MPI is called only out of parallel regions, i.e. by master thread */
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#else
+    MPI_Init(&argc, &argv);
+#endif
+    {
+        double T, a, b;
+        unsigned N;
+        Options opts;
+        double time = -MPI_Wtime();
+
+        /* Communicator constants */
+        int rank, size;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+#ifdef _OPENMP
+        if (provided < MPI_THREAD_FUNNELED)
+            ERRORPRINT("MPI does not support threads!\n");
+#endif
+
+        /* Arguments parsing */
+        if (argc < 5 || parseOptions(argc, argv, &opts))
+        {
+            const char* const* line = usage;
+            if (!rank)
+                for (fprintf(stderr, "Syntax error!\n"); *line; ++line)
+                    fprintf(stderr, "%s", *line);
+            MPI_Finalize();
+            return 1;
+        }
+
+        T = strtod(argv[1], NULL);
+        a = strtod(argv[3], NULL);
+        b = strtod(argv[4], NULL);
+        N = strtoul(argv[2], NULL, 0);
+
+        heat(a, b, T, N, rank, size, &opts);
+
+        if (!rank)
+            fprintf(stdout, "Time is %.15f\n", time += MPI_Wtime());
+    }
+    MPI_Finalize();
+    return 0;
+}
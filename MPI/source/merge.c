@@ -2,9 +2,11 @@
  * merge.c
  *
  * Merge sort with MPI
+ * Input file is text with one number in every line, or binary file
+ * of tests/gen -binary, sorted file has the same format.
  *
  * @author pikryukov
- * @version 3.2
+ * @version 3.7
  * 
  * e-mail: kryukov@frtk.ru
  *
@@ -12,13 +14,82 @@
  * for MIPT MPI course.
  */
  
-#include <stdio.h>  /* fprintf, fscanf, fopen, fclose, rewind, fgets */
-#include <stdlib.h> /* malloc, free */
-#include <string.h> /* strcat */
+/* mmap is POSIX */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>  /* fprintf, fopen, fread, fwrite, fclose, sprintf */
+#include <stdlib.h> /* malloc, realloc, free */
+#include <string.h> /* strcat, strcmp, memcmp, memcpy, memset */
+#include <limits.h> /* INT_MAX */
+
+#include <fcntl.h>    /* open */
+#include <unistd.h>   /* close, sysconf */
+#include <sys/mman.h> /* mmap, munmap */
+#include <sys/stat.h> /* fstat */
 
 #include <mpi.h>
 
+/* Vector kernels are built with GCC target attributes for x86 only */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define X86_KERNELS
+#   include <immintrin.h>
+#endif
+
+/* Bytes read at once after range of thread to finish its last line */
+#define TAIL 256
+
+/* Large ranges are read and written by blocks of this size, as MPI counts are int */
+#define IO_BLOCK (1 << 20)
+
+/* Counting sort is used if range of keys is less than this or than amount */
+#define COUNTING_RANGE (1u << 16)
+
+/* Bits of key sorted by one pass of radix sort, counters fit L1 cache */
+#define RADIX_BITS 11
+#define RADIX (1u << RADIX_BITS)
+
+/* Less arrays are sorted by merge sort */
+#define MERGE_LIMIT 64
+
+/* Merge sort starts from sorted blocks of this size, it is width of AVX2 */
+#define BLOCK 8
+
 #define ERRORPRINT(x) {if (!rank) fprintf(stderr, x); MPI_Finalize(); exit(1);}
+
+/* Usage is split at lines, as ISO C90 does not allow long strings */
+static const char* const usage[] =
+{
+    "Arguments are following: filename [options]\n",
+    "Options:\n",
+    "  -psrs           parallel sorting by regular sampling, every thread\n",
+    "                  writes its range of sorted array\n",
+    "  -sort s         local sort: merge, counting, radix or auto (default),\n",
+    "                  auto chooses by range of keys\n",
+    "  -kernel s       merge kernel: scalar, avx2\n",
+    NULL
+};
+
+/**
+ * Header of binary file, numbers follow it
+ * Numbers are stored in native byte order (little-endian on x86),
+ * file of another byte order is rejected by elemSize.
+ */
+typedef struct
+{
+    char magic[4];     /* "KEYS" */
+    unsigned elemSize; /* Size of one number in bytes */
+    unsigned N;        /* Amount of numbers */
+} Header;
+
+/**
+ * Optional run parameters
+ */
+typedef struct
+{
+    int psrs;           /* Sample sort instead of merging to 0 thread */
+    const char* sort;   /* Name of local sort, NULL for auto choice */
+    const char* kernel; /* Name of merge kernel, NULL for the best one */
+} Options;
  
 /**
  * Scatters grid to threads with minimal recip
@@ -69,42 +140,285 @@ void scatter(unsigned N, int* sendcl, int* destcl, int* gathercl, int size)
     }
 }
 
-/**
- * Counts amount of lines in file
- * @param file file pointer
- * @return amount of lines in file
- */
-unsigned countLines(FILE* file)
-{
-    unsigned lines = 0;
-    char buf[256];
-    while(fgets(buf, 256, file) != NULL)
-        lines++;
-    rewind(file);
-    return lines;
-}
-
 /**
  * Prints array to file
  * @param data array pointer
  * @param N size of array
  * @param filename file name
+ * @param binary 1 for binary file, 0 for text one
  */
-void print(const int* data, size_t N, const char* filename)
+void print(const int* data, size_t N, const char* filename, int binary)
 {
     char file[256] = "sorted_";
     size_t i;
     FILE* fp = NULL;
     
     strcat(file, filename);
-    fp = fopen(file, "w");
+    fp = fopen(file, binary ? "wb" : "w");
 
-    for (i = 0; i < N; ++i)
-        fprintf(fp, "%d\n", *(data++));
+    if (binary)
+    {
+        Header header = {{'K', 'E', 'Y', 'S'}, sizeof(int), 0};
+        header.N = N;
+        fwrite(&header, sizeof(Header), 1, fp);
+        fwrite(data, sizeof(int), N, fp);
+    }
+    else
+        for (i = 0; i < N; ++i)
+            fprintf(fp, "%d\n", *(data++));
 
     fclose(fp);
 }
 
+/**
+ * Kernel merging two sorted arrays to the third one
+ * @param fst 1st array
+ * @param fs size of 1st array
+ * @param snd 2nd array
+ * @param ss size of 2nd array
+ * @param out output array of size fs + ss
+ */
+typedef void (*Merger)(const int* fst, size_t fs, const int* snd, size_t ss, int* out);
+
+/**
+ * Kernel sorting every block of BLOCK numbers in array, the last one may be shorter
+ * @param buf array
+ * @param size array size
+ */
+typedef void (*BlockSorter)(int* buf, size_t size);
+
+/**
+ * Branchless scalar merge, index of taken array is incremented by comparison
+ * result, so random data causes no mispredictions
+ * @see Merger
+ */
+void mergeScalar(const int* fst, size_t fs, const int* snd, size_t ss, int* out)
+{
+    size_t i = 0, j = 0;
+    while (i < fs && j < ss)
+    {
+        const int x = fst[i], y = snd[j];
+        const int second = y < x;
+        *(out++) = second ? y : x;
+        j += second;
+        i += !second;
+    }
+    memcpy(out, fst + i, (fs - i) * sizeof(int));
+    memcpy(out + fs - i, snd + j, (ss - j) * sizeof(int));
+}
+
+/**
+ * Scalar sort of blocks by insertion
+ * @see BlockSorter
+ */
+void sortBlocksScalar(int* buf, size_t size)
+{
+    size_t b, i, j;
+    for (b = 0; b < size; b += BLOCK)
+    {
+        const size_t end = b + BLOCK < size ? b + BLOCK : size;
+        for (i = b + 1; i < end; ++i)
+        {
+            const int key = buf[i];
+            for (j = i; j > b && buf[j - 1] > key; --j)
+                buf[j] = buf[j - 1];
+            buf[j] = key;
+        }
+    }
+}
+
+/* Kernels chosen at start up */
+static Merger mergeKernel = mergeScalar;
+static BlockSorter sortBlocks = sortBlocksScalar;
+
+#ifdef X86_KERNELS
+/**
+ * Bitonic merge of two sorted vectors
+ * Reversed hi and lo form bitonic sequence, min and max of them split it to
+ * lower and higher halves, which are sorted by exchanges at distances 4, 2, 1.
+ * @param lo 1st vector, the lower 8 numbers on exit
+ * @param hi 2nd vector, the higher 8 numbers on exit
+ */
+__attribute__((target("avx2")))
+static void bitonicAVX2(__m256i* lo, __m256i* hi)
+{
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i r = _mm256_permutevar8x32_epi32(*hi, reverse);
+    __m256i v[2], p, mn, mx;
+    int i;
+
+    v[0] = _mm256_min_epi32(*lo, r);
+    v[1] = _mm256_max_epi32(*lo, r);
+    for (i = 0; i < 2; ++i)
+    {
+        p = _mm256_permute2x128_si256(v[i], v[i], 1);
+        mn = _mm256_min_epi32(v[i], p);
+        mx = _mm256_max_epi32(v[i], p);
+        v[i] = _mm256_blend_epi32(mn, mx, 0xF0);
+
+        p = _mm256_shuffle_epi32(v[i], _MM_SHUFFLE(1, 0, 3, 2));
+        mn = _mm256_min_epi32(v[i], p);
+        mx = _mm256_max_epi32(v[i], p);
+        v[i] = _mm256_blend_epi32(mn, mx, 0xCC);
+
+        p = _mm256_shuffle_epi32(v[i], _MM_SHUFFLE(2, 3, 0, 1));
+        mn = _mm256_min_epi32(v[i], p);
+        mx = _mm256_max_epi32(v[i], p);
+        v[i] = _mm256_blend_epi32(mn, mx, 0xAA);
+    }
+    *lo = v[0];
+    *hi = v[1];
+}
+
+/**
+ * AVX2 merge by 8 numbers
+ * The higher vector of bitonic merge stays in register, the lower one is
+ * written, next 8 numbers are loaded from the array with the lesser head.
+ * When that array has less than 8 numbers, its tail and the higher vector
+ * are merged to the small buffer, which is merged with the other array.
+ * @see Merger
+ */
+__attribute__((target("avx2")))
+void mergeAVX2(const int* fst, size_t fs, const int* snd, size_t ss, int* out)
+{
+    int high[BLOCK], buf[2 * BLOCK];
+    size_t i = BLOCK, j = BLOCK;
+    __m256i lo, hi;
+
+    if (fs < BLOCK || ss < BLOCK)
+    {
+        mergeScalar(fst, fs, snd, ss, out);
+        return;
+    }
+
+    lo = _mm256_loadu_si256((const __m256i*)fst);
+    hi = _mm256_loadu_si256((const __m256i*)snd);
+
+    /* Source is chosen without branch while both arrays have whole vectors */
+    while (i + BLOCK <= fs && j + BLOCK <= ss)
+    {
+        const int first = fst[i] <= snd[j];
+        const int* next = first ? fst + i : snd + j;
+        bitonicAVX2(&lo, &hi);
+        _mm256_storeu_si256((__m256i*)out, lo);
+        out += BLOCK;
+        lo = _mm256_loadu_si256((const __m256i*)next);
+        i += first * BLOCK;
+        j += !first * BLOCK;
+    }
+
+    for (;;)
+    {
+        bitonicAVX2(&lo, &hi);
+        _mm256_storeu_si256((__m256i*)out, lo);
+        out += BLOCK;
+
+        /* Array with the lesser head must have whole vector */
+        if (i < fs && (j == ss || fst[i] <= snd[j]))
+        {
+            if (i + BLOCK > fs)
+                break;
+            lo = _mm256_loadu_si256((const __m256i*)(fst + i));
+            i += BLOCK;
+        }
+        else
+        {
+            if (j + BLOCK > ss)
+                break;
+            lo = _mm256_loadu_si256((const __m256i*)(snd + j));
+            j += BLOCK;
+        }
+    }
+
+    /* Higher vector is kept apart from buffer, as merge must not overlap */
+    _mm256_storeu_si256((__m256i*)high, hi);
+    if (fs - i < BLOCK)
+    {
+        mergeScalar(high, BLOCK, fst + i, fs - i, buf);
+        mergeScalar(buf, BLOCK + fs - i, snd + j, ss - j, out);
+    }
+    else
+    {
+        mergeScalar(high, BLOCK, snd + j, ss - j, buf);
+        mergeScalar(buf, BLOCK + ss - j, fst + i, fs - i, out);
+    }
+}
+
+/**
+ * AVX2 sort of blocks by sorting network
+ * Every 8 blocks are loaded to 8 vectors, network of 19 comparators sorts
+ * their columns, and transpose makes columns the sorted blocks.
+ * @see BlockSorter
+ */
+__attribute__((target("avx2")))
+void sortBlocksAVX2(int* buf, size_t size)
+{
+    static const int network[19][2] =
+    {
+        {0, 2}, {1, 3}, {4, 6}, {5, 7}, {0, 4}, {1, 5}, {2, 6}, {3, 7},
+        {0, 1}, {2, 3}, {4, 5}, {6, 7}, {2, 4}, {3, 5}, {1, 4}, {3, 6},
+        {1, 2}, {3, 4}, {5, 6}
+    };
+    __m256i r[BLOCK], t[BLOCK], u[BLOCK];
+    size_t b;
+    int k;
+
+    for (b = 0; b + BLOCK * BLOCK <= size; b += BLOCK * BLOCK)
+    {
+        for (k = 0; k < BLOCK; ++k)
+            r[k] = _mm256_loadu_si256((const __m256i*)(buf + b + k * BLOCK));
+        for (k = 0; k < 19; ++k)
+        {
+            const __m256i x = r[network[k][0]], y = r[network[k][1]];
+            r[network[k][0]] = _mm256_min_epi32(x, y);
+            r[network[k][1]] = _mm256_max_epi32(x, y);
+        }
+
+        /* Transpose of 8x8 matrix */
+        for (k = 0; k < BLOCK; k += 2)
+        {
+            t[k] = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+            t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+        }
+        for (k = 0; k < BLOCK; k += 4)
+        {
+            u[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+            u[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+            u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+            u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+        }
+        for (k = 0; k < 4; ++k)
+        {
+            r[k] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x20);
+            r[k + 4] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x31);
+        }
+
+        for (k = 0; k < BLOCK; ++k)
+            _mm256_storeu_si256((__m256i*)(buf + b + k * BLOCK), r[k]);
+    }
+    sortBlocksScalar(buf + b, size - b);
+}
+#endif
+
+/**
+ * Chooses merge kernel
+ * @param name name of kernel, NULL for the best supported one
+ * @return name of chosen kernel, NULL if it is not supported
+ */
+const char* chooseKernel(const char* name)
+{
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (name ? !strcmp(name, "avx2") : __builtin_cpu_supports("avx2"))
+    {
+        mergeKernel = mergeAVX2;
+        sortBlocks = sortBlocksAVX2;
+        return __builtin_cpu_supports("avx2") ? "avx2" : NULL;
+    }
+#endif
+    return (!name || !strcmp(name, "scalar")) ? "scalar" : NULL;
+}
+
 /**
  * Merge of two parts of one array
  * @param fst array pointer
@@ -115,36 +429,169 @@ void print(const int* data, size_t N, const char* filename)
  */
 size_t merge(int* fst, size_t fs, size_t ss, int* temp)
 {
-    size_t ts = fs + ss;
-    const size_t ts_ret = ts;
-    const int* snd = fst + fs;
-    while (fs > 0 && ss > 0)
-        *(temp + --ts) = *(fst + fs - 1) > *(snd + ss - 1)
-            ? *(fst + --fs)
-            : *(snd + --ss);
-    while (ss > 0)
-        *(temp + --ts) = *(snd + --ss);
-    for (ts = fs; ts < ts_ret; ++ts)
-        *(fst + ts) = *(temp + ts);
-    return ts_ret;
+    mergeKernel(fst, fs, fst + fs, ss, temp);
+    memcpy(fst, temp, (fs + ss) * sizeof(int));
+    return fs + ss;
 }
 
 /**
- * Recursive merge sort
+ * Bottom-up merge sort
+ * Blocks are sorted by kernel, then runs of doubling width are merged
+ * from buf to temp and back, array is copied only if it ends in temp.
  * @param buf sorting buffer
  * @param size buffer size
  * @param temp temporary memory
  */
-void mergeSort(int* buf, size_t size, int* temp) {
-    size_t split = size / 2;
+void mergeSort(int* buf, size_t size, int* temp)
+{
+    int* src = buf;
+    int* dst = temp;
+    size_t width, i;
 
-    if (split > 1)
-        mergeSort(buf, split, temp);
+    sortBlocks(buf, size);
+    for (width = BLOCK; width < size; width <<= 1)
+    {
+        int* swap;
+        for (i = 0; i < size; i += 2 * width)
+        {
+            const size_t mid = i + width < size ? i + width : size;
+            const size_t end = mid + width < size ? mid + width : size;
+            mergeKernel(src + i, mid - i, src + mid, end - mid, dst + i);
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
 
-    if (size - split > 1)
-        mergeSort(buf + split, size - split, temp);
-        
-    merge(buf, split, size - split, temp);
+    if (src != buf)
+        memcpy(buf, src, size * sizeof(int));
+}
+
+/**
+ * Counting sort of keys from min to min + range
+ * Counters are 32-bit, as amount of numbers of thread is int. If range is
+ * less than size, they are kept in temporary memory, otherwise allocated.
+ * @param buf sorting buffer
+ * @param size buffer size
+ * @param temp temporary memory of the same size
+ * @param min minimal key
+ * @param range difference between maximal and minimal keys
+ * @return 0 on success, -1 if counters cannot be allocated
+ */
+int countingSort(int* buf, size_t size, int* temp, int min, unsigned range)
+{
+    const int own = range >= size;
+    unsigned* counts = own ? (unsigned*)malloc(((size_t)range + 1) * sizeof(unsigned))
+                           : (unsigned*)temp;
+    size_t i;
+    unsigned j;
+
+    if (!counts)
+        return -1;
+    memset(counts, 0, ((size_t)range + 1) * sizeof(unsigned));
+
+    for (i = 0; i < size; ++i)
+        ++counts[(unsigned)buf[i] - (unsigned)min];
+
+    /* Keys are restored from counters, (unsigned) avoids overflow of min + i */
+    for (i = 0; i <= range; ++i)
+        for (j = counts[i]; j > 0; --j)
+            *(buf++) = (int)((unsigned)min + (unsigned)i);
+
+    if (own)
+        free(counts);
+    return 0;
+}
+
+/**
+ * LSD radix sort by RADIX_BITS bits of key - min
+ * Keys are moved between buf and temp, passes where all keys have
+ * the same digit are skipped.
+ * @param buf sorting buffer
+ * @param size buffer size
+ * @param temp temporary memory
+ * @param min minimal key
+ * @param range difference between maximal and minimal keys
+ */
+void radixSort(int* buf, size_t size, int* temp, int min, unsigned range)
+{
+    size_t counts[RADIX];
+    int* src = buf;
+    int* dst = temp;
+    unsigned shift;
+    size_t i;
+
+    for (shift = 0; shift < 32 && (range >> shift); shift += RADIX_BITS)
+    {
+        size_t sum = 0;
+        int* swap;
+
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < size; ++i)
+            ++counts[(((unsigned)src[i] - (unsigned)min) >> shift) & (RADIX - 1)];
+        if (counts[(((unsigned)src[0] - (unsigned)min) >> shift) & (RADIX - 1)] == size)
+            continue;
+
+        /* Counters become offsets of digits */
+        for (i = 0; i < RADIX; ++i)
+        {
+            const size_t count = counts[i];
+            counts[i] = sum;
+            sum += count;
+        }
+        for (i = 0; i < size; ++i)
+            dst[counts[(((unsigned)src[i] - (unsigned)min) >> shift) & (RADIX - 1)]++] = src[i];
+
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != buf)
+        memcpy(buf, src, size * sizeof(int));
+}
+
+/**
+ * Local sort of thread
+ * Merge sort is used for small arrays, otherwise range of keys is scanned:
+ * narrow range is sorted by counting sort, wide one by radix sort.
+ * Forced counting sort of wide range is replaced by radix sort too.
+ * @param buf sorting buffer
+ * @param size buffer size
+ * @param temp temporary memory of the same size
+ * @param name name of sort, NULL for auto choice
+ * @return name of used sort
+ */
+const char* localSort(int* buf, size_t size, int* temp, const char* name)
+{
+    int min, max;
+    unsigned range;
+    size_t i;
+
+    if (size < 2)
+        return "none";
+    if ((!name && size < MERGE_LIMIT) || (name && !strcmp(name, "merge")))
+    {
+        mergeSort(buf, size, temp);
+        return "merge";
+    }
+
+    for (min = max = buf[0], i = 1; i < size; ++i)
+    {
+        if (buf[i] < min)
+            min = buf[i];
+        if (buf[i] > max)
+            max = buf[i];
+    }
+    range = (unsigned)max - (unsigned)min;
+
+    /* Counters of wide range would take more memory than data, even if forced */
+    if ((range < COUNTING_RANGE || range < size) && (!name || !strcmp(name, "counting"))
+        && !countingSort(buf, size, temp, min, range))
+        return "counting";
+
+    radixSort(buf, size, temp, min, range);
+    return "radix";
 }
 
 /*
@@ -184,13 +631,408 @@ size_t receive(size_t myAmount, int* gather, int* buf, int* temp, int rank, int
 }
 
 /**
- * Reads file to array of integer numbers
- * @param filename filename
- * @param array output array
+ * Finds amount of elements not greater than key
+ * @param data sorted array
+ * @param n size of array
+ * @param key key
+ * @return index of the first element greater than key
  */
-void readArray(FILE* fp, int* array)
+size_t upperBound(const int* data, size_t n, int key)
 {
-    while ( fscanf(fp, "%d\n", array++) != EOF);
+    size_t lo = 0;
+    while (n > 0)
+    {
+        const size_t half = n / 2;
+        if (data[lo + half] <= key)
+        {
+            lo += half + 1;
+            n -= half + 1;
+        }
+        else
+            n = half;
+    }
+    return lo;
+}
+
+/**
+ * Merges sorted runs following each other in one array by pairs
+ * till the only run remains
+ * @param data array of runs
+ * @param counts sizes of runs, they are changed
+ * @param runs amount of runs
+ * @param temp temporary memory of array size
+ */
+void mergeRuns(int* data, int* counts, int runs, int* temp)
+{
+    int step, i;
+    for (step = 1; step < runs; step <<= 1)
+    {
+        size_t offset = 0;
+        for (i = 0; i < runs; i += 2 * step)
+        {
+            if (i + step < runs)
+                counts[i] = merge(data + offset, counts[i], counts[i + step], temp);
+            offset += counts[i];
+        }
+    }
+}
+
+/*
+ * Parallel sorting by regular sampling (PSRS):
+ *
+ *  sorted parts:  |a..a..a..|b..b..b..|c..c..c..|  <- samples
+ *  splitters:     every size-th of sorted samples
+ *  all-to-all:    |aaa|aa|aaaa|  -> thread 0 gets elements up to splitter 1,
+ *                                   thread 1 gets the next ones, etc.
+ *
+ * Every thread gets sorted run from every thread and merges them,
+ * so it owns contiguous range of sorted array not larger than 2 N / size
+ * for different keys.
+ */
+/**
+ * Sample sort of sorted parts
+ * @param data sorted part of thread
+ * @param amount size of part
+ * @param sorted range of sorted array owned by thread, should be freed
+ * @param rank mpi rank
+ * @param size mpi size
+ * @return size of owned range
+ */
+size_t psrs(const int* data, size_t amount, int** sorted, int rank, int size)
+{
+    int* sendcnts = (int*)malloc(sizeof(int) * size);
+    int* sdispls  = (int*)malloc(sizeof(int) * size);
+    int* recvcnts = (int*)malloc(sizeof(int) * size);
+    int* rdispls  = (int*)malloc(sizeof(int) * size);
+    int* splitters = (int*)malloc(sizeof(int) * size);
+    int* samples = NULL;
+    int* temp;
+    int count = amount < size ? amount : size;
+    size_t total = 0, taken = 0;
+    int i;
+
+    /* Regular samples of every thread are gathered to 0 thread */
+    for (i = 0; i < count; ++i)
+        splitters[i] = data[i * amount / count];
+    MPI_Gather(&count, 1, MPI_INT, recvcnts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!rank)
+    {
+        for (i = 0; i < size; ++i)
+        {
+            rdispls[i] = total;
+            total += recvcnts[i];
+        }
+        samples = (int*)malloc(sizeof(int) * (total + 1));
+        temp = (int*)malloc(sizeof(int) * (total + 1));
+    }
+    MPI_Gatherv(splitters, count, MPI_INT, samples, recvcnts, rdispls, MPI_INT,
+                0, MPI_COMM_WORLD);
+
+    /* Splitter i is the first sample of i-th part of sorted samples */
+    if (!rank)
+    {
+        if (total > 1)
+            mergeSort(samples, total, temp);
+        for (i = 1; i < size; ++i)
+            splitters[i - 1] = total ? samples[i * total / size] : INT_MAX;
+        free(temp);
+        free(samples);
+    }
+    MPI_Bcast(splitters, size - 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    /* Thread i gets elements greater than splitter i - 1 and not greater than splitter i */
+    for (i = 0; i < size; ++i)
+    {
+        const size_t bound = i < size - 1 ? upperBound(data, amount, splitters[i]) : amount;
+        sdispls[i] = taken;
+        sendcnts[i] = bound > taken ? bound - taken : 0;
+        taken += sendcnts[i];
+    }
+    MPI_Alltoall(sendcnts, 1, MPI_INT, recvcnts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    total = 0;
+    for (i = 0; i < size; ++i)
+    {
+        rdispls[i] = total;
+        total += recvcnts[i];
+    }
+    *sorted = (int*)malloc(sizeof(int) * (total + 1));
+    temp = (int*)malloc(sizeof(int) * (total + 1));
+    MPI_Alltoallv((void*)data, sendcnts, sdispls, MPI_INT,
+                  *sorted, recvcnts, rdispls, MPI_INT, MPI_COMM_WORLD);
+    mergeRuns(*sorted, recvcnts, size, temp);
+
+    free(temp);
+    free(splitters);
+    free(rdispls);
+    free(recvcnts);
+    free(sdispls);
+    free(sendcnts);
+    return total;
+}
+
+/**
+ * Collective writing of range, which may be longer than INT_MAX bytes,
+ * in the same way as readAll()
+ * @param fh file
+ * @param offset offset of range in file
+ * @param buf written buffer
+ * @param length length of range
+ */
+void writeAll(MPI_File fh, MPI_Offset offset, char* buf, MPI_Offset length)
+{
+    const MPI_Offset blocks = length / IO_BLOCK;
+    MPI_Datatype block;
+
+    MPI_Type_contiguous(IO_BLOCK, MPI_CHAR, &block);
+    MPI_Type_commit(&block);
+    MPI_File_write_at_all(fh, offset, buf, (int)blocks, block, MPI_STATUS_IGNORE);
+    MPI_File_write_at_all(fh, offset + blocks * IO_BLOCK, buf + blocks * IO_BLOCK,
+                          (int)(length % IO_BLOCK), MPI_CHAR, MPI_STATUS_IGNORE);
+    MPI_Type_free(&block);
+}
+
+/**
+ * Writes ranges of sorted array of all threads to file with collective MPI-IO
+ * Every thread prints its range to buffer, offsets in file are prefix sums
+ * of buffer sizes.
+ * @param data range of thread
+ * @param n size of range
+ * @param filename name of sorted file
+ * @param N size of the whole array
+ * @param binary 1 for binary file, 0 for text one
+ */
+void printParallel(const int* data, size_t n, const char* filename, size_t N, int binary)
+{
+    char file[256] = "sorted_";
+    char* text = binary ? (char*)data : (char*)malloc(12 * n + 1);
+    long length = 0, offset = 0;
+    int rank;
+    size_t i;
+    MPI_File fh;
+
+    strcat(file, filename);
+    if (binary)
+        length = n * sizeof(int);
+    else
+        for (i = 0; i < n; ++i)
+            length += sprintf(text + length, "%d\n", data[i]);
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Exscan(&length, &offset, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (!rank)
+        offset = 0;
+
+    MPI_File_open(MPI_COMM_WORLD, file, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                  MPI_INFO_NULL, &fh);
+    MPI_File_set_size(fh, 0);
+    if (binary)
+    {
+        Header header = {{'K', 'E', 'Y', 'S'}, sizeof(int), 0};
+        header.N = N;
+        if (!rank)
+            MPI_File_write_at(fh, 0, &header, sizeof(Header), MPI_BYTE, MPI_STATUS_IGNORE);
+        offset += sizeof(Header);
+    }
+    writeAll(fh, offset, text, length);
+    MPI_File_close(&fh);
+    if (!binary)
+        free(text);
+}
+
+/**
+ * Parses integer numbers of text, one number in every line
+ * @param text text
+ * @param length length of text
+ * @param array output array, not less than amount of lines
+ * @return amount of parsed numbers
+ */
+size_t parse(const char* text, size_t length, int* array)
+{
+    const char* const end = text + length;
+    const int* const first = array;
+
+    while (text < end)
+    {
+        unsigned value = 0;
+        int negative = 0;
+        const char* digits;
+
+        if (*text == '\n' || *text == '\r' || *text == ' ' || *text == '\t')
+        {
+            ++text;
+            continue;
+        }
+        if (*text == '-' || *text == '+')
+            negative = *(text++) == '-';
+        for (digits = text; text < end && *text >= '0' && *text <= '9'; ++text)
+            value = value * 10 + (*text - '0');
+
+        /* Lines without number are skipped */
+        if (text == digits)
+        {
+            while (text < end && *text != '\n')
+                ++text;
+            continue;
+        }
+        *(array++) = negative ? (int)(0u - value) : (int)value;
+    }
+    return array - first;
+}
+
+/**
+ * Collective reading of range, which may be longer than INT_MAX bytes
+ * Range is read as whole blocks of IO_BLOCK bytes and the rest, so every
+ * thread makes the same two collective calls.
+ * @param fh file
+ * @param offset offset of range in file
+ * @param buf output buffer
+ * @param length length of range
+ */
+void readAll(MPI_File fh, MPI_Offset offset, char* buf, MPI_Offset length)
+{
+    const MPI_Offset blocks = length / IO_BLOCK;
+    MPI_Datatype block;
+
+    MPI_Type_contiguous(IO_BLOCK, MPI_CHAR, &block);
+    MPI_Type_commit(&block);
+    MPI_File_read_at_all(fh, offset, buf, (int)blocks, block, MPI_STATUS_IGNORE);
+    MPI_File_read_at_all(fh, offset + blocks * IO_BLOCK, buf + blocks * IO_BLOCK,
+                         (int)(length % IO_BLOCK), MPI_CHAR, MPI_STATUS_IGNORE);
+    MPI_Type_free(&block);
+}
+
+/*
+ * Parallel reading: file is split at equal byte ranges, and every line
+ * belongs to the thread whose range contains its first byte:
+ *
+ *  range:  |0        |1        |2        |
+ *  file:   12\n345\n6789\n0\n12\n345\n67\n
+ *  lines:  |0   |0     |1       |2  |2   |
+ *
+ * So thread skips the head of the line started before its range
+ * and reads its last line after the end of range.
+ */
+/**
+ * Reads numbers of file by all threads
+ * @param filename file name
+ * @param array numbers of thread, should be freed
+ * @param amount amount of numbers of thread
+ * @param rank mpi rank
+ * @param size mpi size
+ * @return 0 on success, -1 if file cannot be opened
+ */
+int readParallel(const char* filename, int** array, size_t* amount, int rank, int size)
+{
+    MPI_File fh;
+    MPI_Offset length, begin, end, tail;
+    int previous;
+    char* text;
+    size_t head = 0, read;
+
+    if (MPI_File_open(MPI_COMM_WORLD, (char*)filename, MPI_MODE_RDONLY,
+                      MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+        return -1;
+    MPI_File_get_size(fh, &length);
+
+    /* The previous byte tells if range starts with a new line */
+    begin = length * rank / size;
+    end = length * (rank + 1) / size;
+    previous = begin > 0;
+    begin -= previous;
+    read = end - begin;
+    text = (char*)malloc(read + TAIL);
+    readAll(fh, begin, text, read);
+
+    /* The last line is read till its end */
+    for (tail = end; read > 0 && text[read - 1] != '\n' && tail < length; tail += TAIL)
+    {
+        const MPI_Offset piece = length - tail < TAIL ? length - tail : TAIL;
+        MPI_Offset i;
+
+        text = (char*)realloc(text, read + TAIL);
+        MPI_File_read_at(fh, tail, text + read, piece, MPI_CHAR, MPI_STATUS_IGNORE);
+        for (i = 0; i < piece && text[read + i] != '\n'; ++i)
+            ;
+        read += i < piece ? i + 1 : piece;
+    }
+    MPI_File_close(&fh);
+
+    /* Head of the line started in previous range belongs to previous thread */
+    if (previous)
+        while (head < read && text[head] != '\n')
+            ++head;
+
+    /* Every number takes at least two bytes with end of line */
+    *array = (int*)malloc(sizeof(int) * ((read - head) / 2 + 1));
+    *amount = parse(text + head, read - head, *array);
+    free(text);
+    return 0;
+}
+
+/**
+ * Reads header of file by 0 thread and broadcasts it
+ * @param filename file name
+ * @param header read header
+ * @return 1 for binary file, 0 for text one, -1 if file cannot be opened
+ */
+int readHeader(const char* filename, Header* header)
+{
+    int rank, binary = -1;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (!rank)
+    {
+        FILE* fp = fopen(filename, "rb");
+        if (fp)
+        {
+            binary = fread(header, sizeof(Header), 1, fp) == 1
+                  && !memcmp(header->magic, "KEYS", 4);
+            fclose(fp);
+        }
+    }
+    MPI_Bcast(&binary, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(header, sizeof(Header), MPI_BYTE, 0, MPI_COMM_WORLD);
+    return binary;
+}
+
+/**
+ * Reads part of binary file through memory mapping, so file is not
+ * copied to buffers of stdio
+ * Only pages with numbers of thread are mapped.
+ * @param filename file name
+ * @param first index of the first read number
+ * @param amount amount of read numbers
+ * @param data output array
+ * @return 0 on success, -1 if file cannot be mapped or it is truncated
+ */
+int readBinary(const char* filename, size_t first, size_t amount, int* data)
+{
+    const size_t begin = sizeof(Header) + first * sizeof(int);
+    const size_t end = begin + amount * sizeof(int);
+    const size_t base = begin - begin % (size_t)sysconf(_SC_PAGESIZE);
+    struct stat st;
+    void* map;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) || (size_t)st.st_size < end)
+    {
+        close(fd);
+        return -1;
+    }
+
+    map = amount ? mmap(NULL, end - base, PROT_READ, MAP_PRIVATE, fd, (off_t)base) : NULL;
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    if (amount)
+    {
+        memcpy(data, (char*)map + (begin - base), amount * sizeof(int));
+        munmap(map, end - base);
+    }
+    return 0;
 }
 
 /**
@@ -198,31 +1040,51 @@ void readArray(FILE* fp, int* array)
  * @param filename name of file with sorting array
  * @param rank mpi rank
  * @param size mpi size
+ * @param opts run options
  */
-void mpisort(const char* filename, int rank, int size)
+void mpisort(const char* filename, int rank, int size, const Options* opts)
 {
     /* N is amount of lines in file */
     unsigned N;
+    long total;
     
     int* sendcnts  = (int*)malloc(sizeof(int) * size); /* Amount to send to */
                                                        /* thread */
     int* displs    = (int*)malloc(sizeof(int) * size); /* Displacement */
     int* gathercnt = (int*)malloc(sizeof(int) * size); /* Amount to collect from */
                                                        /* thread */
+    int* movecnts  = (int*)malloc(sizeof(int) * size); /* Parsed numbers moved to */
+    int* movedispls = (int*)malloc(sizeof(int) * size); /* thread, and received */
+    int* recvcnts  = (int*)malloc(sizeof(int) * size); /* from it */
+    int* recvdispls = (int*)malloc(sizeof(int) * size);
 
-    size_t amount, gather, send_to;
-    int *data, *temp;
-    
-    /* Zero thread will read the file */
-    FILE* fp = NULL;
-    if (!rank)
-    {
-        fp = fopen(filename, "r");
-        N = countLines(fp);
-    }
+    size_t amount, gather, send_to, parsed = 0;
+    int *data, *temp, *numbers = NULL;
+    long count, offset = 0;
+    int i, failed;
+    double sortTime;
+    const char* sortName;
+    Header header;
 
-    /* Broadcasting amount of numbers in file */
-    MPI_Bcast(&N, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    /* Binary file is split at once, text one is parsed by every thread */
+    const int binary = readHeader(filename, &header);
+    const char* kernelName = chooseKernel(opts->kernel);
+    if (!kernelName)
+        ERRORPRINT("Kernel is not supported!\n");
+    if (binary < 0)
+        ERRORPRINT("Cannot open file!\n");
+    if (binary && header.elemSize != sizeof(int))
+        ERRORPRINT("Binary file has another size of numbers or byte order!\n");
+    if (!binary && readParallel(filename, &numbers, &parsed, rank, size))
+        ERRORPRINT("Cannot open file!\n");
+
+    /* Amount of numbers in file and index of the first parsed one */
+    count = parsed;
+    MPI_Exscan(&count, &offset, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (!rank)
+        offset = 0;
+    MPI_Allreduce(&count, &total, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    N = binary ? header.N : total;
     
     /* Scatter split */
     scatter(N, sendcnts, displs, gathercnt, size);
@@ -230,62 +1092,148 @@ void mpisort(const char* filename, int rank, int size)
     /* amount of lines to sort on current thread */
     amount = sendcnts[rank];
     
-    /* total amount of lines that can be allocated on current thread */
-    gather = gathercnt[rank];
+    /* total amount of lines that can be allocated on current thread,
+       sample sort keeps its own range only */
+    gather = opts->psrs ? amount : (size_t)gathercnt[rank];
 
-    data = (int*)malloc(sizeof(int) * gather);
-    temp = (int*)malloc(sizeof(int) * gather);
-    
-    if (!rank)
+    data = (int*)malloc(sizeof(int) * (gather + 1));
+    temp = (int*)malloc(sizeof(int) * (gather + 1));
+
+    /* Every thread maps its part of binary file */
+    failed = binary && readBinary(filename, displs[rank], amount, data);
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+    if (failed)
+        ERRORPRINT("Binary file is truncated!\n");
+
+    /* Parsed numbers are moved to their threads of scatter split */
+    for (i = 0; i < size && !binary; ++i)
+    {
+        const long lo = offset > displs[i] ? offset : displs[i];
+        const long hi = offset + count < displs[i] + sendcnts[i]
+                      ? offset + count : displs[i] + sendcnts[i];
+        movecnts[i] = hi > lo ? hi - lo : 0;
+        movedispls[i] = hi > lo ? lo - offset : 0;
+    }
+    if (!binary)
     {
-        readArray(fp, temp);
-        fclose(fp);
+        MPI_Alltoall(movecnts, 1, MPI_INT, recvcnts, 1, MPI_INT, MPI_COMM_WORLD);
+        for (i = 0; i < size; ++i)
+            recvdispls[i] = i ? recvdispls[i - 1] + recvcnts[i - 1] : 0;
+        MPI_Alltoallv(numbers, movecnts, movedispls, MPI_INT,
+                      data, recvcnts, recvdispls, MPI_INT, MPI_COMM_WORLD);
+        free(numbers);
     }
 
-    MPI_Scatterv(temp, sendcnts, displs, MPI_INT, 
-                 data, amount, MPI_INT,
-                 0, MPI_COMM_WORLD);
+    /* Sort time does not include reading and writing */
+    MPI_Barrier(MPI_COMM_WORLD);
+    sortTime = -MPI_Wtime();
                  
-    if (amount > 1)
-        mergeSort(data, amount, temp);
+    sortName = localSort(data, amount, temp, opts->sort);
 
-    /* Receive and merge data from younger thread */
-    send_to = receive(amount, gathercnt, data, temp, rank, size);
-
-    if (rank)
-        /* Send data to elder thread */
-        MPI_Send(data, gather, MPI_INT, send_to, 0, MPI_COMM_WORLD);
+    if (opts->psrs)
+    {
+        int* sorted;
+        const size_t owned = psrs(data, amount, &sorted, rank, size);
+        sortTime += MPI_Wtime();
+        printParallel(sorted, owned, filename, N, binary);
+        free(sorted);
+    }
     else
+    {
+        /* Receive and merge data from younger thread */
+        send_to = receive(amount, gathercnt, data, temp, rank, size);
+
+        if (rank)
+            /* Send data to elder thread */
+            MPI_Send(data, gather, MPI_INT, send_to, 0, MPI_COMM_WORLD);
+        sortTime += MPI_Wtime();
+
         /* The eldest thread collected all necessary data and won't send it */
-        print(data, N, filename);
-    
+        if (!rank)
+            print(data, N, filename, binary);
+    }
+
+    MPI_Reduce(rank ? &sortTime : MPI_IN_PLACE, &sortTime, 1, MPI_DOUBLE, MPI_MAX,
+               0, MPI_COMM_WORLD);
+    if (!rank)
+    {
+        fprintf(stdout, "Local sort of 0 thread is %s, merge kernel is %s\n",
+                sortName, kernelName);
+        fprintf(stdout, "Sort time is %.15f\n", sortTime);
+    }
+
     free(data);
     free(temp);
+    free(recvdispls);
+    free(recvcnts);
+    free(movedispls);
+    free(movecnts);
     free(gathercnt);
     free(sendcnts);
     free(displs);
 }
 
+/**
+ * Parses optional arguments
+ * @param argc argument counter
+ * @param argv argument list, options start from 2nd one
+ * @param opts parsed options
+ * @return 0 on success, -1 on unknown options
+ */
+int parseOptions(int argc, char** argv, Options* opts)
+{
+    int i;
+    opts->psrs = 0;
+    opts->sort = NULL;
+    opts->kernel = NULL;
+
+    for (i = 2; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-psrs"))
+            opts->psrs = 1;
+        else if (!strcmp(argv[i], "-sort") && i + 1 < argc
+                 && (!strcmp(argv[i + 1], "merge") || !strcmp(argv[i + 1], "counting")
+                     || !strcmp(argv[i + 1], "radix") || !strcmp(argv[i + 1], "auto")))
+        {
+            ++i;
+            opts->sort = strcmp(argv[i], "auto") ? argv[i] : NULL;
+        }
+        else if (!strcmp(argv[i], "-kernel") && i + 1 < argc)
+            opts->kernel = argv[++i];
+        else
+            return -1;
+    }
+    return 0;
+}
+
 /**
  * Entry point
- * @param argc argument counter, should be 2
- * @param argv argument list (filename)
+ * @param argc argument counter, should be 2 or more
+ * @param argv argument list (filename, options)
  */
 int main(int argc, char** argv)
 {
     MPI_Init(&argc, &argv);
     {
         double time = -MPI_Wtime();
+        Options opts;
     
         /* Communicator constants */
         int rank, size;
         MPI_Comm_rank(MPI_COMM_WORLD, &rank);
         MPI_Comm_size(MPI_COMM_WORLD, &size);
-    
-        if (argc != 2)
-            ERRORPRINT("Syntax error!\n Only argument is file name\n");
-    
-        mpisort(argv[1], rank, size);
+
+        if (argc < 2 || parseOptions(argc, argv, &opts))
+        {
+            const char* const* line = usage;
+            if (!rank)
+                for (fprintf(stderr, "Syntax error!\n"); *line; ++line)
+                    fprintf(stderr, "%s", *line);
+            MPI_Finalize();
+            return 1;
+        }
+
+        mpisort(argv[1], rank, size, &opts);
     
         if (!rank)
         fprintf(stdout, "Time is %.15f\n", time += MPI_Wtime());
@@ -2,6 +2,7 @@
 
 if "%1"=="heat" goto :heat
 if "%1"=="merge" goto :merge
+if "%1"=="kernels" goto :kernels
 goto :error
 
 :merge
@@ -21,6 +22,13 @@ erase testfile
 
 goto :compare
 
+:kernels
+
+echo [test] Comparing AVX2 and scalar merge kernels...
+tests\merge_kernels
+
+goto :end
+
 :heat
 set ORIGINAL=serial_result.txt
 set PARALLEL=result_kryukov.txt
@@ -30,6 +38,10 @@ tests\serial_heat 2.0 100 1.0 1.0
 
 call run %2 -rb heat %3 2.0 100 1.0 1.0
 
+echo [test] Converting binary result to text...
+tests\heat2txt result_kryukov.bin %PARALLEL%
+erase result_kryukov.bin
+
 :compare
 
 echo [test] Converting file to DOS format...
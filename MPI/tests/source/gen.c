@@ -2,9 +2,11 @@
  * gen.c
  *
  * Generating random integer numbers
+ * With -binary numbers are written as raw ints after header, the same
+ * as in merge.c, so sort may be measured without parsing of text.
  *
  * @author pikryukov
- * @version 2.0
+ * @version 2.1
  *
  * e-mail: kryukov@frtk.ru
  *
@@ -14,26 +16,50 @@
  
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+/**
+ * Header of binary file, the same as in merge.c
+ */
+typedef struct
+{
+    char magic[4];     /* "KEYS" */
+    unsigned elemSize; /* Size of one number in bytes */
+    unsigned N;        /* Amount of numbers */
+} Header;
+
 int main(int argc, char** argv)
 {
-    if (argc != 3)
+    if (argc != 3 && (argc != 4 || strcmp(argv[3], "-binary")))
     {
         fprintf(stderr, "Syntax error!\n");
         fprintf(stderr, "First argument is the amount of ints, second is filename\n");
+        fprintf(stderr, "Optional third argument -binary writes binary file\n");
         return 1;
     }
     
     const unsigned N = atoi(argv[1]);
+    const int binary = argc == 4;
     unsigned i;
     
     srand(time(NULL));
     
-    FILE* fp = fopen(argv[2], "w");
+    FILE* fp = fopen(argv[2], binary ? "wb" : "w");
     
-    for (i = 0; i < N; ++i)
-        fprintf(fp, "%d\n", rand() & 0xFFFF);
+    if (binary)
+    {
+        Header header = {{'K', 'E', 'Y', 'S'}, sizeof(int), N};
+        fwrite(&header, sizeof(Header), 1, fp);
+        for (i = 0; i < N; ++i)
+        {
+            const int value = rand() & 0xFFFF;
+            fwrite(&value, sizeof(int), 1, fp);
+        }
+    }
+    else
+        for (i = 0; i < N; ++i)
+            fprintf(fp, "%d\n", rand() & 0xFFFF);
         
     fclose(fp);
     
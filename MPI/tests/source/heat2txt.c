@@ -0,0 +1,85 @@
+/**
+ * heat2txt.c
+ *
+ * Converting binary result of heat.c to text table
+ * Points may be stored in double or in float (heat.c built with -DSINGLE).
+ *
+ * @author pikryukov
+ * @version 1.2
+ *
+ * e-mail: kryukov@frtk.ru
+ *
+ * Copyright (C) Kryukov Pavel 2012
+ * for MIPT MPI course.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Header of binary file with grid, the same as in heat.c
+ */
+typedef struct
+{
+    char magic[4];     /* "HEAT" */
+    unsigned N;        /* Grid size */
+    unsigned elemSize; /* Size of one point in bytes */
+    unsigned steps;    /* Amount of steps made */
+    unsigned order;    /* Order of scheme, 2 or 4 */
+    unsigned reserved; /* Zero, keeps parameters aligned */
+    double T, a, b;    /* Parameters of run */
+} Header;
+
+/**
+ * Entry point
+ * @param argc argument counter, should be 3
+ * @param argv argument list (binary file name, text file name)
+ */
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Syntax error!\n");
+        fprintf(stderr, "First argument is binary file, second is text file\n");
+        return 1;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    Header header;
+    if (fread(&header, sizeof(Header), 1, in) != 1
+        || memcmp(header.magic, "HEAT", 4)
+        || (header.elemSize != sizeof(double) && header.elemSize != sizeof(float)))
+    {
+        fprintf(stderr, "%s is not a result of heat\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+
+    FILE* out = fopen(argv[2], "w");
+    char* row = (char*)malloc(header.elemSize * header.N);
+
+    for (unsigned y = 0; y < header.N; ++y)
+    {
+        if (fread(row, header.elemSize, header.N, in) != header.N)
+        {
+            fprintf(stderr, "%s is truncated\n", argv[1]);
+            break;
+        }
+        for (unsigned x = 0; x < header.N; ++x)
+            fprintf(out, "%8.3f\t", header.elemSize == sizeof(float)
+                                     ? ((float*)row)[x] : ((double*)row)[x]);
+        fprintf(out, "\n");
+    }
+
+    free(row);
+    fclose(out);
+    fclose(in);
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * merge_kernels.c
+ *
+ * Comparison of AVX2 and scalar merge kernels of merge.c
+ * Kernels merge arrays of all sizes up to several vectors, so every tail
+ * of vector merge is checked, and sort arrays up to several blocks.
+ * Kernels are called directly, so they are inlined as in merge.c.
+ *
+ * @author pikryukov
+ * @version 1.0
+ *
+ * e-mail: kryukov@frtk.ru
+ *
+ * Copyright (C) Kryukov Pavel 2012
+ * for MIPT MPI course.
+ */
+
+/* Kernels are taken from merge.c itself */
+#define main mergeMain
+#include "../../source/merge.c"
+#undef main
+
+/* Maximal size of merged array */
+#define MAXSIZE (9 * BLOCK)
+
+/* Random arrays merged for every pair of sizes */
+#define TRIALS 8
+
+/* Maximal size of sorted array */
+#define MAXSORT (12 * BLOCK * BLOCK)
+
+/**
+ * Compares to ints via pointers without overflow
+ * @param a fst int pointer
+ * @param b snd int pointer
+ * @return sign of difference between a and b values
+ */
+int cmp(const void* a, const void* b)
+{
+    const int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Fills array with random numbers
+ * @param data array
+ * @param n size of array
+ * @param range amount of different numbers, 0 for all ints
+ */
+void fillRandom(int* data, size_t n, int range)
+{
+    for (size_t i = 0; i < n; ++i)
+        data[i] = range ? rand() % range : (int)(((unsigned)rand() << 16) ^ (unsigned)rand());
+}
+
+/**
+ * Entry point
+ * @return 0 if kernels are equal, 1 otherwise
+ */
+int main(void)
+{
+#ifndef X86_KERNELS
+    fprintf(stderr, "There are no AVX2 kernels, nothing to compare\n");
+    return 0;
+#else
+    static const int ranges[] = {0, 1000, 4};
+    static int fst[MAXSIZE], snd[MAXSIZE], scalar[2 * MAXSIZE], vector[2 * MAXSIZE];
+    static int data[MAXSORT], sorted[MAXSORT], temp[MAXSORT];
+    unsigned errors = 0;
+
+    if (!chooseKernel("avx2"))
+    {
+        fprintf(stderr, "AVX2 is not supported, nothing to compare\n");
+        return 0;
+    }
+
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); ++r)
+    {
+        for (size_t fs = 0; fs <= MAXSIZE; ++fs)
+            for (size_t ss = 0; ss <= MAXSIZE; ++ss)
+                for (unsigned t = 0; t < TRIALS; ++t)
+                {
+                    fillRandom(fst, fs, ranges[r]);
+                    fillRandom(snd, ss, ranges[r]);
+                    qsort(fst, fs, sizeof(int), &cmp);
+                    qsort(snd, ss, sizeof(int), &cmp);
+
+                    mergeScalar(fst, fs, snd, ss, scalar);
+                    mergeAVX2(fst, fs, snd, ss, vector);
+                    if (memcmp(scalar, vector, (fs + ss) * sizeof(int)))
+                    {
+                        fprintf(stderr, "Merge of %zu and %zu numbers differs\n", fs, ss);
+                        ++errors;
+                    }
+                }
+
+        for (size_t n = 0; n <= MAXSORT; n += n < 4 * BLOCK ? 1 : 7)
+        {
+            fillRandom(data, n, ranges[r]);
+            memcpy(sorted, data, n * sizeof(int));
+            qsort(sorted, n, sizeof(int), &cmp);
+
+            mergeSort(data, n, temp);
+            if (memcmp(sorted, data, n * sizeof(int)))
+            {
+                fprintf(stderr, "Sort of %zu numbers differs\n", n);
+                ++errors;
+            }
+        }
+    }
+
+    fprintf(stdout, errors ? "Kernels differ in %u cases\n" : "Kernels are equal\n", errors);
+    return errors > 0;
+#endif
+}
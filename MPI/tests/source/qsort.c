@@ -2,9 +2,10 @@
  * qsort.c
  *
  * QSort of file
+ * Binary file of gen -binary is sorted to binary file.
  *
  * @author pikryukov
- * @version 1.0
+ * @version 1.2
  *
  * e-mail: kryukov@frtk.ru
  *
@@ -16,6 +17,16 @@
 #include <stdlib.h>
 #include <string.h>
  
+/**
+ * Header of binary file, the same as in merge.c
+ */
+typedef struct
+{
+    char magic[4];     /* "KEYS" */
+    unsigned elemSize; /* Size of one number in bytes */
+    unsigned N;        /* Amount of numbers */
+} Header;
+
 /**
  * Counts amount of lines in file
  * @param file file pointer
@@ -45,11 +56,12 @@ void readArray(FILE* fp, int* array)
  * Compares to ints via pointers
  * @param a fst int pointer
  * @param b snd int pointer
- * @return difference between a and b values
+ * @return sign of difference between a and b values, which may overflow
  */
 int cmp(const void* a, const void* b)
 {
-    return *(int*)a - *(int*)b;
+    const int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
 }
 
 /**
@@ -57,15 +69,23 @@ int cmp(const void* a, const void* b)
  * @param data array pointer
  * @param N size of array
  * @param filename file name
+ * @param binary 1 for binary file, 0 for text one
  */
-void print(const int* data, size_t N, const char* filename)
+void print(const int* data, size_t N, const char* filename, int binary)
 {
     char file[256] = "qsorted_";
     strcat(file, filename);
-    FILE* fp = fopen(file, "w");
+    FILE* fp = fopen(file, binary ? "wb" : "w");
 
-    for (size_t i = 0; i < N; ++i)
-        fprintf(fp, "%d\n", *(data++));
+    if (binary)
+    {
+        Header header = {{'K', 'E', 'Y', 'S'}, sizeof(int), N};
+        fwrite(&header, sizeof(Header), 1, fp);
+        fwrite(data, sizeof(int), N, fp);
+    }
+    else
+        for (size_t i = 0; i < N; ++i)
+            fprintf(fp, "%d\n", *(data++));
 
     fclose(fp);
 }
@@ -82,15 +102,25 @@ int main(int argc, char** argv)
         return 1;
     }
         
-    FILE* fp = fopen(argv[1], "r");
-    unsigned N = countLines(fp);
+    FILE* fp = fopen(argv[1], "rb");
+    Header header;
+    const int binary = fread(&header, sizeof(Header), 1, fp) == 1
+                    && !memcmp(header.magic, "KEYS", 4)
+                    && header.elemSize == sizeof(int);
+    if (!binary)
+        rewind(fp);
+    unsigned N = binary ? header.N : countLines(fp);
     
     int* data = (int*)malloc(sizeof(int) * N);
-    readArray(fp, data);
+    if (binary)
+        N = fread(data, sizeof(int), N, fp);
+    else
+        readArray(fp, data);
+    fclose(fp);
     
     qsort(data, N, sizeof(int), &cmp);
     
-    print(data, N, argv[1]);
+    print(data, N, argv[1], binary);
     
     return 0;
 }